@@ -1,5 +1,6 @@
 #include <unicode/ucnv.h>
 #include <unicode/uchar.h>
+#include <unicode/uset.h>
 #include <stdio.h>
 #include <stdbool.h>
 #include <stdlib.h>
@@ -8,6 +9,21 @@
 #include <ctype.h>
 #include <locale.h>
 #include <uchar.h>
+#include <unistd.h>
+#include <errno.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <termios.h>
+#include <time.h>
+#ifdef __GLIBC__
+#include <gnu/libc-version.h>
+#include <malloc.h>
+#endif
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 #ifdef ENABLE_ICONV
 #include <iconv.h>
 #include <errno.h>
@@ -17,15 +33,19 @@
 void * libiconv_open (const char* tocode, const char* fromcode);
 size_t libiconv (void * cd,  char* * inbuf, size_t *inbytesleft, char* * outbuf, size_t *outbytesleft);
 int libiconv_close (void * cd);
+extern int _libiconv_version;
 #endif
 #ifdef ENABLE_GCONV
 #include <gconv.h>
 #include <dlfcn.h>
+#include <dirent.h>
 #endif
 #ifdef ENABLE_MAPFILE
 #include "mapconv/mapping_file_parser.h"
 #endif 
+#include "cpdisp.h"
 
+#ifndef CPDISP_LIBRARY
 static const char helptext[] = "\n\
 Generate nice looking charts of character encodings within the terminal.\n\
 \n\
@@ -33,20 +53,43 @@ Usage:\n\
     -h --help : print this help.\n\
     -w --wide: print 2 byte table.\n\
     -d [filename] : load custom icu data file.\n\
-    -i : require user input between pages (only if -w is enabled).\n\
+    -i : browse the tables on a terminal (arrows move, n/p page, two hex digits jump, enter zooms into a cell, u goes back, q quits), otherwise wait for enter between pages of -w.\n\
     -r --range [from]:[to] : display only pages associated with this range of bytes.\n\
     -n --no-format : no format.\n\
     -N --raw : no format and print control character raw.\n\
     -x [byte]:[byte]:[byte]... : prefix in hex.\n\
     -c : print hex code and name of control characters and whitespace characters.\n\
-    -z : Column Major Order\n"
+    -z : Column Major Order\n\
+    -j --jobs [n] : convert and render tables on n threads (0 for one per core).\n\
+    --cache[=dir] : keep converted tables in dir (default ~/.cache/cpdisp) and reuse them.\n\
+    --skip-dead : leave out tables whose lead byte is invalid or a whole character.\n\
+    --show-dead : print those tables in full instead of a one line summary.\n\
+    --explore[=n] : follow every incomplete character up to n bytes past the prefix (default 4).\n\
+    --stateful[=n] : convert the prefix once and start every cell where it left the converter, for each shift state reachable with escapes of up to n bytes (default 4).\n\
+    --reverse[=U+X:U+Y] : show the bytes each code point in the range encodes to (not with --mapfile or --gconv).\n\
+    --all : chart every ICU converter, each into its own file.\n\
+    --list [filename] : chart every codepage named in the file (- for stdin), each into its own file.\n\
+    -o --output [dir] : directory for --all and --list (default .).\n\
+    --diff [backend:]codepage : list the cells where another codepage or backend disagrees, exits with 1 if any do.\n\
+    --format [ansi|jsonl|csv|binary] : write one record per cell instead of a chart.\n\
+    --names : add the names of the code points to jsonl and csv records.\n\
+    --heatmap [filename] : shade the chart by how often each cell occurs in the file (- for stdin).\n\
+    --validate [filename] : list every offset where the file isn't clean in this codepage, exits with 1 if any.\n\
+    --detect [filename] : rank every ICU converter (or those named by --list) by how many problems they find in the file.\n\
+    --compile-map [filename] : write the codepage as a mapping image that --mapfile can load without parsing.\n\
+    --stats[=file] : time opening, converting, classifying, naming, formatting and writing, and count cells of each colour, per table. On stderr, or as JSON in file.\n\
+    --benchmark[=n] : time n runs (default 3) of charting and bulk converting the codepages with every backend, and of the stateful ones.\n"
 #ifdef ENABLE_ICONV
 "    --iconv : use iconv backend.\n"
 #endif 
 #ifdef ENABLE_LIBICONV
 "    --libiconv : use libiconv backend.\n"
 #endif
-"    --locale : use locale instead.\n\
+#ifdef ENABLE_GCONV
+"    --gconv : call the glibc charset module for the codepage (or module.so:charset) directly.\n"
+#endif
+"    --mapfile : codepage is a mapping image (or with ENABLE_MAPFILE, a mapping file).\n\
+    --locale : use locale instead.\n\
 \n\
 Legend:\n\
     Blue: Control Character\n\
@@ -55,9 +98,12 @@ Legend:\n\
     Purple/Dark Magenta: Private Use Character\n\
     Dark Yellow: Something I didn't expect\n\
 \n";
+#endif
 #include <threads.h>
+#include <stdatomic.h>
 thread_local static UErrorCode err=U_ZERO_ERROR , idc=U_ZERO_ERROR;
 
+#ifndef CPDISP_LIBRARY
 static const int attribute_red_background = 41;
 static const int attribute_green_background=42;
 static const int attribute_yellow_background=43;
@@ -66,6 +112,8 @@ static const int attribute_magenta_background=45;
 static const int attribute_light_gray_background=47;
 static const int attribute_default_background=49;
 static const int attribute_bright_blue_background = 104;
+/* Plus a color from the 256 color palette */
+static const int attribute_256_background = 256;
 
 char * u_strToUTF8 	( 	char *  	dest,
 		int32_t  	destCapacity,
@@ -74,110 +122,445 @@ char * u_strToUTF8 	( 	char *  	dest,
 		int32_t  	srcLength,
 		UErrorCode *  	pErrorCode 
 	);
-static UBool u_isundefined(UChar32 c) {return !u_isdefined(c);}
-const UChar * find_predicate_in_string(const UChar * str, UBool (*predicate)(UChar32), size_t length ){
-    if (length==0) return NULL;
-    UChar32 c;
-    int i=0;
-    do {
-        int ibak=i;
-        U16_NEXT(str, i, length, c);
-        if (predicate(c)) return &str[ibak];
-    } while(i<length);
-    return NULL;
+#endif
+/*
+ * Everything the renderer wants to know about a code point, looked up
+ * with two array reads instead of a handful of property calls. The table
+ * is split into blocks of 256 code points which are filled in the first
+ * time anything in them is looked up, a chart only ever touches a few
+ * dozen of them.
+ */
+enum {
+    CP_UNDEFINED = CPDISP_UNDEFINED,   /* !u_isdefined */
+    CP_CONTROL = CPDISP_CONTROL,       /* u_iscntrl */
+    CP_WHITESPACE = CPDISP_WHITESPACE, /* u_isUWhiteSpace */
+    CP_PUA = CPDISP_PUA,               /* U_PRIVATE_USE_CHAR */
+    CP_COMBINING = CPDISP_COMBINING,   /* Mn, Me or Mc */
+    CP_NONSPACING = CPDISP_NONSPACING, /* Mn */
+    CP_WIDE = CPDISP_WIDE,             /* East Asian Wide or Fullwidth */
+    CP_NOT_LTR = CPDISP_NOT_LTR        /* u_charDirection isn't U_LEFT_TO_RIGHT */
+};
+static _Atomic(uint8_t *) cp_flags_blocks[0x110000>>8];
+
+static uint8_t * build_cp_flags_block(UChar32 block){
+    uint8_t * flags=malloc(256);
+    for (int i=0; i<256; i++){
+        const UChar32 c=block<<8|i;
+        const int8_t category=u_charType(c);
+        const int32_t ea_width=u_getIntPropertyValue(c, UCHAR_EAST_ASIAN_WIDTH);
+        flags[i]=
+            (category==U_UNASSIGNED?CP_UNDEFINED:0) |
+            (u_iscntrl(c)?CP_CONTROL:0) |
+            (u_isUWhiteSpace(c)?CP_WHITESPACE:0) |
+            (category==U_PRIVATE_USE_CHAR?CP_PUA:0) |
+            (
+                category==U_NON_SPACING_MARK ||
+                category==U_ENCLOSING_MARK ||
+                category==U_COMBINING_SPACING_MARK?CP_COMBINING:0
+            ) |
+            (category==U_NON_SPACING_MARK?CP_NONSPACING:0) |
+            (ea_width==U_EA_FULLWIDTH || ea_width==U_EA_WIDE?CP_WIDE:0) |
+            (u_charDirection(c)!=U_LEFT_TO_RIGHT?CP_NOT_LTR:0);
+    }
+    uint8_t * expected=NULL;
+    /* Another thread may have beaten us to it */
+    if (!atomic_compare_exchange_strong(&cp_flags_blocks[block], &expected, flags)){
+        free(flags);
+        return expected;
+    }
+    return flags;
+}
+static inline uint8_t cp_flags(UChar32 c){
+    if ((uint32_t)c > 0x10ffff) return CP_UNDEFINED;
+    uint8_t * block=atomic_load_explicit(&cp_flags_blocks[c>>8], memory_order_acquire);
+    if (!block) block=build_cp_flags_block(c>>8);
+    return block[c&0xff];
+}
+
+#ifndef CPDISP_LIBRARY
+/*
+ * Tables are rendered into an OutBuf and written with one write() each.
+ * The buffer keeps its capacity between tables so after the first few
+ * tables rendering doesn't allocate. attribute is the background the
+ * terminal is set to at the end of buf, 0 if it isn't known.
+ */
+typedef struct {
+    char * buf;
+    size_t length, capacity;
+    int attribute;
+} OutBuf;
+
+static void out_reserve(OutBuf * out, size_t extra){
+    if (out->buf && out->length+extra <= out->capacity) return;
+    size_t capacity=out->capacity?out->capacity:4096;
+    while (capacity < out->length+extra) capacity*=2;
+    out->buf=realloc(out->buf, capacity);
+    out->capacity=capacity;
+}
+static void out_append(OutBuf * out, const char * str, size_t length){
+    out_reserve(out, length);
+    memcpy(out->buf+out->length, str, length);
+    out->length+=length;
+}
+static void out_str(OutBuf * out, const char * str){
+    out_append(out, str, strlen(str));
+}
+#define out_literal(out, str) out_append(out, str, sizeof(str)-1)
+static void out_char(OutBuf * out, char c){
+    out_reserve(out, 1);
+    out->buf[out->length++]=c;
+}
+static const char hex_digits[]="0123456789abcdef";
+static void out_uint(OutBuf * out, unsigned value){
+    char digits[10];
+    int i=sizeof(digits);
+    do digits[--i]='0'+value%10; while (value/=10);
+    out_append(out, digits+i, sizeof(digits)-i);
+}
+static void out_codepoint(OutBuf * out, UChar32 codepoint){
+    static const char upper_hex_digits[16]="0123456789ABCDEF";
+    out_literal(out, "U+");
+    for (int shift=codepoint > 0xffff?20:12; shift >= 0; shift-=4)
+        out_char(out, upper_hex_digits[(codepoint>>shift)&15]);
+}
+static const uint64_t fnv1a_basis=0xcbf29ce484222325;
+static uint64_t fnv1a(uint64_t hash, const void * data, size_t length){
+    const unsigned char * bytes=data;
+    for (size_t i=0; i<length; i++){
+        hash^=bytes[i];
+        hash*=0x100000001b3;
+    }
+    return hash;
+}
+/* "\e[NNm" for every attribute below 108, length in the first byte */
+static char sgr_table[108][8];
+static once_flag sgr_table_once=ONCE_FLAG_INIT;
+static void build_sgr_table(){
+    for (int i=0; i<108; i++){
+        OutBuf tmp={.buf=sgr_table[i]+1, .capacity=sizeof(sgr_table[i])-1};
+        out_literal(&tmp, "\e[");
+        out_uint(&tmp, i);
+        out_char(&tmp, 'm');
+        sgr_table[i][0]=tmp.length;
+    }
+}
+static void out_sgr(OutBuf * out, int attribute){
+    if (attribute >= 0 && attribute < 108) {
+        call_once(&sgr_table_once, build_sgr_table);
+        out_append(out, sgr_table[attribute]+1, sgr_table[attribute][0]);
+    } else if (attribute >= attribute_256_background) {
+        /* Black text on the light end of the palette's gray ramp */
+        const int color=attribute-attribute_256_background;
+        out_literal(out, "\e[48;5;");
+        out_uint(out, color);
+        out_str(out, color >= 246 && color <= 255?";30m":";39m");
+    } else {
+        out_literal(out, "\e[");
+        out_uint(out, attribute);
+        out_char(out, 'm');
+    }
+}
+static void out_flush(OutBuf * out, int fd){
+    size_t written=0;
+    while (written < out->length){
+        ssize_t result=write(fd, out->buf+written, out->length-written);
+        if (result < 0 && errno == EINTR) continue;
+        if (result < 0) break;
+        written+=result;
+    }
+    out->length=0;
 }
 
-static UBool u_isPUA(UChar32 c){
-    return u_charType(c)==U_PRIVATE_USE_CHAR;
+/*
+ * --stats: time spent in each phase and cells of each legend colour, per
+ * table. current_stats points at the table the thread is working on and
+ * is NULL unless --stats was given, so a span costs a thread local load
+ * and a branch when it's off.
+ */
+typedef enum {
+    PHASE_OPEN,
+    PHASE_CONVERT,
+    PHASE_CLASSIFY,
+    PHASE_NAMES,
+    PHASE_FORMAT,
+    PHASE_WRITE,
+    PHASE_COUNT
+} StatsPhase;
+typedef enum {
+    LEGEND_PLAIN,
+    LEGEND_CONTROL,
+    LEGEND_WHITESPACE,
+    LEGEND_INVALID,
+    LEGEND_TRUNCATED,
+    LEGEND_PUA,
+    LEGEND_ERROR,
+    LEGEND_COUNT
+} LegendCategory;
+static const char * const phase_names[]={
+    [PHASE_OPEN]="open",
+    [PHASE_CONVERT]="convert",
+    [PHASE_CLASSIFY]="classify",
+    [PHASE_NAMES]="names",
+    [PHASE_FORMAT]="format",
+    [PHASE_WRITE]="write"
+};
+static const char * const legend_names[]={
+    [LEGEND_PLAIN]="plain",
+    [LEGEND_CONTROL]="control",
+    [LEGEND_WHITESPACE]="whitespace",
+    [LEGEND_INVALID]="invalid",
+    [LEGEND_TRUNCATED]="truncated",
+    [LEGEND_PUA]="private use",
+    [LEGEND_ERROR]="error"
+};
+typedef struct {
+    uint64_t ns[PHASE_COUNT];
+    uint64_t cells[LEGEND_COUNT];
+    uint64_t names;
+    bool used;
+} Stats;
+static Stats stats_setup, stats_tables[256];
+thread_local static Stats * current_stats;
+
+static uint64_t monotonic_ns(){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec*UINT64_C(1000000000)+ts.tv_nsec;
+}
+static inline uint64_t stats_begin(){
+    return current_stats?monotonic_ns():0;
+}
+static inline void stats_end(StatsPhase phase, uint64_t start){
+    if (current_stats) current_stats->ns[phase]+=monotonic_ns()-start;
 }
 
-static void attrPrint(int attribute, char * str){
-    printf("\e[%dm\xe2\x80\xad%s\xe2\x80\xac", attribute,str);
+static void attrSet(OutBuf * out, int attribute){
+    if (out->attribute == attribute) return;
+    /* Palette backgrounds may have changed the text color too */
+    if (out->attribute >= attribute_256_background && attribute < attribute_256_background)
+        out_literal(out, "\e[39m");
+    out_sgr(out, attribute);
+    out->attribute=attribute;
+}
+/* End the line with the default background so it doesn't bleed into the next one */
+static void attrReset(OutBuf * out, const char * newlines){
+    if (out->attribute != attribute_default_background)
+        out_literal(out, "\e[0m");
+    out->attribute=attribute_default_background;
+    out_str(out, newlines);
+}
+static void attrPrint(OutBuf * out, int attribute, const char * str){
+    attrSet(out, attribute);
+    out_str(out, str);
 }
-static void attrPrintSpace(int attribute){
-    attrPrint(attribute, "  ");
+/* Wrapped in U+202D LEFT-TO-RIGHT OVERRIDE and U+202C POP DIRECTIONAL FORMATTING */
+static void attrPrintIsolated(OutBuf * out, int attribute, const char * str){
+    attrSet(out, attribute);
+    out_literal(out, "\xe2\x80\xad");
+    out_str(out, str);
+    out_literal(out, "\xe2\x80\xac");
+}
+static void attrPrintSpace(OutBuf * out, int attribute){
+    attrPrint(out, attribute, "  ");
 }
 
-static bool iswide(UChar * str, size_t len){
-    int width=0;
-    int i=0;
-    UChar32 c;
-    while(i<len){
-        U16_NEXT(str, i, len, c);
-        if (u_charType(c)!=U_NON_SPACING_MARK || c==0xfe0f){
-			int ea_width=u_getIntPropertyValue(c,UCHAR_EAST_ASIAN_WIDTH);
-			if (
-                width == 1 ||
-                ea_width==U_EA_FULLWIDTH ||
-                ea_width == U_EA_WIDE) return true;
-			else width+=1;
-        }
+/*
+ * Names for -c and --names. Every code point -c can ask about (controls,
+ * format characters, separators and whitespace) is named once, the first
+ * time any name is needed, into one hash table shared by every thread.
+ * Anything else is looked up and kept in a small table of the thread's
+ * own, which stops growing once it's full.
+ */
+typedef struct {
+    UChar32 codepoint;
+    uint32_t offset;
+    uint32_t length;
+} NameEntry;
+typedef struct {
+    NameEntry * entries;
+    size_t mask, count;
+    OutBuf text;
+} NameTable;
+enum { name_cache_limit=4096 };
+static NameTable name_index;
+static once_flag name_index_once=ONCE_FLAG_INIT;
+thread_local static NameTable name_cache;
 
-    }
-    return false;
+static NameEntry * name_slot(const NameTable * table, UChar32 codepoint){
+    for (size_t i=(codepoint*UINT32_C(2654435761))&table->mask;; i=(i+1)&table->mask)
+        if (table->entries[i].codepoint == codepoint || table->entries[i].codepoint < 0)
+            return &table->entries[i];
+}
 
+static void name_table_init(NameTable * table, size_t capacity){
+    size_t size=16;
+    while (size < 2*capacity) size*=2;
+    table->entries=malloc(size*sizeof(NameEntry));
+    for (size_t i=0; i<size; i++) table->entries[i].codepoint=-1;
+    table->mask=size-1;
+    table->count=0;
 }
-static size_t message_index=0;
-static char * messages[256];
-static void attrPrintMessage(int attribute, const char * message){
-    char message_index_string[3] =
-        {'A'+(message_index/16),'A'+(message_index%16),'\0'};
-    attrPrint(attribute, message_index_string);
-    const size_t formatted_message_size=17+strlen(message);
-    char * message_formatted=malloc(formatted_message_size);
-    snprintf(message_formatted,formatted_message_size,"\e[%dm%s: %s\e[49m\n",
-        attribute, 
-        message_index_string,
-        message
+
+static NameEntry * name_table_add(NameTable * table, UChar32 codepoint){
+    NameEntry * entry=name_slot(table, codepoint);
+    UErrorCode err=U_ZERO_ERROR;
+    /* ICU keeps the capacity in 16 bits, so it's given only what a name can take */
+    enum {name_capacity=128};
+    out_reserve(&table->text, name_capacity);
+    int32_t length=u_charName(
+        codepoint,
+        U_UNICODE_CHAR_NAME,
+        table->text.buf+table->text.length,
+        name_capacity,
+        &err
     );
-    messages[message_index++]=message_formatted;
+    if (U_FAILURE(err)) length=0;
+    *entry=(NameEntry){
+        .codepoint=codepoint,
+        .offset=table->text.length,
+        .length=length
+    };
+    table->text.length+=length;
+    table->count++;
+    return entry;
+}
+
+static void build_name_index(){
+    UErrorCode err=U_ZERO_ERROR;
+    USet * set=uset_openPattern(u"[[:Cc:][:Cf:][:Zl:][:Zp:][:White_Space:]]", -1, &err);
+    if (U_FAILURE(err)) {
+        name_table_init(&name_index, 0);
+        return;
+    }
+    name_table_init(&name_index, uset_size(set));
+    for (int32_t i=0; i<uset_getItemCount(set); i++){
+        UChar32 start, end;
+        uset_getItem(set, i, &start, &end, NULL, 0, &err);
+        for (UChar32 c=start; c<=end; c++)
+            name_table_add(&name_index, c);
+    }
+    uset_close(set);
+}
+
+/* The name of codepoint, not terminated, empty if it has none */
+static const char * char_name(UChar32 codepoint, size_t * length){
+    call_once(&name_index_once, build_name_index);
+    const NameEntry * entry=name_slot(&name_index, codepoint);
+    if (entry->codepoint == codepoint) {
+        *length=entry->length;
+        return name_index.text.buf+entry->offset;
+    }
+    NameTable * cache=&name_cache;
+    if (!cache->entries) name_table_init(cache, name_cache_limit);
+    entry=name_slot(cache, codepoint);
+    if (entry->codepoint != codepoint) {
+        if (cache->count >= name_cache_limit) {
+            static thread_local char scratch[128];
+            UErrorCode err=U_ZERO_ERROR;
+            const int32_t scratch_length=u_charName(codepoint, U_UNICODE_CHAR_NAME, scratch, sizeof(scratch), &err);
+            *length=U_SUCCESS(err)?scratch_length:0;
+            return scratch;
+        }
+        entry=name_table_add(cache, codepoint);
+    }
+    *length=entry->length;
+    return cache->text.buf+entry->offset;
+}
+
+/*
+ * The legend under a table. Each message is kept once in one buffer, the
+ * same text in the same colour gets the same ID, and the lines go out
+ * with the rest of the table. The buffer and the entries stay allocated
+ * from one table to the next.
+ */
+typedef struct {
+    uint64_t hash;
+    uint32_t offset, length;
+    int attribute;
+} LegendEntry;
+typedef struct {
+    OutBuf text;
+    LegendEntry * entries;
+    size_t count, capacity;
+} Legend;
+thread_local static Legend legend;
+
+/* AA to PP like it always was, the first letter goes on from there if it must */
+static void legend_id(size_t index, char id[3]){
+    static const char first[]="ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789";
+    id[0]=first[index/16%(sizeof(first)-1)];
+    id[1]='A'+index%16;
+    id[2]=0;
+}
+
+static void attrPrintMessage(OutBuf * out, int attribute, const char * message){
+    const size_t length=strlen(message);
+    const uint64_t hash=fnv1a(fnv1a_basis, message, length);
+    size_t index=0;
+    while (index < legend.count && !(
+        legend.entries[index].hash == hash &&
+        legend.entries[index].attribute == attribute &&
+        legend.entries[index].length == length &&
+        !memcmp(legend.text.buf+legend.entries[index].offset, message, length)
+    ))
+        index++;
+    if (index == legend.count) {
+        if (legend.count == legend.capacity) {
+            legend.capacity=legend.capacity?legend.capacity*2:64;
+            legend.entries=realloc(legend.entries, legend.capacity*sizeof(LegendEntry));
+        }
+        legend.entries[legend.count++]=(LegendEntry){
+            .hash=hash,
+            .offset=legend.text.length,
+            .length=length,
+            .attribute=attribute
+        };
+        out_append(&legend.text, message, length);
+    }
+    char id[3];
+    legend_id(index, id);
+    attrPrint(out, attribute, id);
 }
 
-static void printAllMessages(){
-    for (size_t i=0; i<message_index; i++){
-        printf("%s",messages[i]);
-        free(messages[i]);
+static void printAllMessages(OutBuf * out){
+    for (size_t i=0; i<legend.count; i++){
+        const LegendEntry * entry=&legend.entries[i];
+        char id[3];
+        legend_id(i, id);
+        out_sgr(out, entry->attribute);
+        out_append(out, id, 2);
+        out_literal(out, ": ");
+        out_append(out, legend.text.buf+entry->offset, entry->length);
+        out_str(out, entry->attribute >= attribute_256_background?"\e[49;39m\n":"\e[49m\n");
     }
-    message_index=0;
+    legend.count=0;
+    legend.text.length=0;
 }
-static void attrPrintRaw(int attribute, unsigned char raw){
-    char buf[3];
-    sprintf(buf,"%02hhx",raw);
-    attrPrint(attribute, buf);
+static void attrPrintRaw(OutBuf * out, int attribute, unsigned char raw){
+    const char buf[3]={hex_digits[raw>>4], hex_digits[raw&0xf], 0};
+    attrPrint(out, attribute, buf);
 }
-static void attrPrintCodepointAsHex(int attribute, const UChar32 codepoint){
+static void attrPrintCodepointAsHex(OutBuf * out, int attribute, const UChar32 codepoint){
     if (codepoint < 0x100){
-        attrPrintRaw(attribute, (unsigned char)codepoint);
+        attrPrintRaw(out, attribute, (unsigned char)codepoint);
     } else {
-        size_t name_length = u_charName(
-            codepoint,
-            U_UNICODE_CHAR_NAME,
-            NULL,
-            0,
-            &idc
-        );
-        idc=U_ZERO_ERROR;
-        char codepoint_str[10+name_length];
-        char name_buffer[name_length+1];
-        const char * format_str;
-
-        u_charName(
-            codepoint,
-            U_UNICODE_CHAR_NAME,
-            name_buffer,
-            name_length+1,
-            &idc
-        );
-        if (codepoint < 0x10000) 
-            format_str="U+%04X %s";
-        else 
-            format_str="U+%06X %s";
-        sprintf(codepoint_str,format_str, codepoint,name_buffer);
-        attrPrintMessage(attribute, codepoint_str);
+        static thread_local OutBuf message;
+        const uint64_t start=stats_begin();
+        size_t name_length;
+        const char * name=char_name(codepoint, &name_length);
+        stats_end(PHASE_NAMES, start);
+        if (current_stats) current_stats->names++;
+        message.length=0;
+        out_codepoint(&message, codepoint);
+        out_char(&message, ' ');
+        out_append(&message, name, name_length);
+        out_char(&message, 0);
+        attrPrintMessage(out, attribute, message.buf);
     }
     
 
 }
+#endif
 
 
 typedef struct {
@@ -201,16 +584,128 @@ typedef enum {
     BACKEND_END
 } Backend;
 #ifdef ENABLE_GCONV
+/* Where the gconv-modules files are when GCONV_PATH isn't set */
+#ifndef GCONV_DIRS
+#define GCONV_DIRS "/usr/lib/x86_64-linux-gnu/gconv:/usr/lib/aarch64-linux-gnu/gconv:/usr/lib64/gconv:/usr/lib/gconv"
+#endif
+/* A glibc charset module driven directly, from the charset to INTERNAL (UCS-4 in host order) */
 typedef struct {
     void * shared_object;
     __gconv_fct gconv;
     __gconv_end_fct gconv_end;
     struct __gconv_step step;
+    char from_name[64];
 } gconv_nonsense;
 #endif
+/*
+ * --mapfile takes a text mapping file (with ENABLE_MAPFILE) or an image
+ * written by --compile-map, which is mapped as is. The image is a trie:
+ * node 0 is the lead byte, every node has an entry for each byte from
+ * first to last, and an entry is a character (a run of UTF-16 units), a
+ * longer sequence (the node for the next byte) or an error code. Bytes
+ * outside a node's range all fail with the same error.
+ */
+enum { MAP_IMAGE_VERSION=1, map_image_depth=4 };
+static const char map_image_magic[8]="cpdisp\0m";
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t node_count;
+    uint32_t entry_count;
+    uint32_t unit_count;
+} MapImageHeader;
+typedef struct {
+    uint32_t entries;
+    int32_t outside;
+    uint8_t first, last;
+    uint16_t unused;
+} MapNode;
+enum {
+    MAP_ENTRY_CHARACTER,
+    MAP_ENTRY_INCOMPLETE,
+    MAP_ENTRY_ERROR
+};
+typedef struct {
+    /* Offset into the units, the next node (UINT32_MAX if it's too deep) or the UErrorCode */
+    uint32_t value;
+    uint8_t kind;
+    uint8_t length;
+    uint16_t unused;
+} MapEntry;
+typedef struct {
+    void * base;
+    size_t size;
+    const MapNode * nodes;
+    const MapEntry * entries;
+    const UChar * units;
+    uint32_t node_count, entry_count, unit_count;
+    #ifdef ENABLE_MAPFILE
+    MappingTable table;
+    #endif
+} MapConverter;
+/*
+ * The locale backend decodes with a trie like a mapping image's. A node
+ * is filled in with mbrtoc16 the first time a chart reaches it, and each
+ * entry is what mbrtoc16 says about the bytes down to it from the initial
+ * state, so converting a cell is a walk down the trie and tables, threads
+ * and benchmark runs share everything decoded so far. The locale is used
+ * with uselocale, so nothing touches the process's own.
+ */
+typedef struct LocaleNode LocaleNode;
+typedef struct {
+    UChar units[2];
+    uint8_t length;
+    uint8_t kind;
+    _Atomic(LocaleNode *) next;
+} LocaleEntry;
+struct LocaleNode {
+    LocaleEntry entries[256];
+};
+typedef struct {
+    locale_t locale;
+    LocaleNode * root;
+} LocaleConverter;
+/* --format */
+typedef enum {
+    FORMAT_ANSI,
+    FORMAT_JSONL,
+    FORMAT_CSV,
+    FORMAT_BINARY
+} OutputFormat;
+
+#ifndef CPDISP_LIBRARY
+static const char * const format_names[]={
+    [FORMAT_ANSI]="ansi",
+    [FORMAT_JSONL]="jsonl",
+    [FORMAT_CSV]="csv",
+    [FORMAT_BINARY]="binary"
+};
+#endif
+struct CellCache;
+struct ConverterState;
 typedef struct {
     void * converter;
+    const char * codepage;
+    const char * data_file;
+    const char * cache_dir;
+    const char * list_file;
+    const char * diff_target;
+    const char * heatmap_file;
+    const char * validate_file;
+    const char * detect_file;
+    const char * stats_file;
+    const char * map_image_file;
+    const char * output_dir;
+    int output_fd;
+    struct CellCache * cache;
+    const uint8_t * table_kinds;
+    const struct ConverterState * state;
+    unsigned short jobs;
     uint8_t from_table, to_table;
+    uint8_t explore_depth;
+    uint8_t stateful_depth;
+    uint8_t benchmark_runs;
+    UChar32 reverse_from, reverse_to;
     Backend backend : 3;
     bool interactive : 1;
     bool no_format_bool : 1;
@@ -220,9 +715,429 @@ typedef struct {
     bool help : 1;
     bool column_order : 1;
     bool verbose_control_codes_and_whitespace : 1;
+    bool skip_dead : 1;
+    bool show_dead : 1;
+    bool reverse : 1;
+    bool all : 1;
+    bool names : 1;
+    bool stats : 1;
+    OutputFormat output_format : 2;
 } Config;
 
 
+#if defined(ENABLE_ICONV) || defined(ENABLE_LIBICONV)
+static const char * utf16_host_endian(){
+    /* Silly endianess hack */
+    union {
+        char is_little_endian:8;
+        UChar32 a;
+    } e={.a=1};
+    return e.is_little_endian?"UTF-16LE":"UTF-16BE";
+}
+#endif
+
+/* 1 if filename is an image and is now mapped, 0 if it's something else, -1 if it can't be read, -2 if it's broken */
+static int open_map_image(const char * filename, MapConverter * map){
+    const int fd=open(filename, O_RDONLY);
+    if (fd < 0) return -1;
+    struct stat st;
+    MapImageHeader header;
+    if (
+        fstat(fd, &st) != 0 ||
+        read(fd, &header, sizeof(header)) != sizeof(header) ||
+        memcmp(header.magic, map_image_magic, sizeof(header.magic))
+    ) {
+        close(fd);
+        return 0;
+    }
+    const uint64_t size=sizeof(header)+
+        (uint64_t)header.node_count*sizeof(MapNode)+
+        (uint64_t)header.entry_count*sizeof(MapEntry)+
+        (uint64_t)header.unit_count*sizeof(UChar);
+    if (header.version != MAP_IMAGE_VERSION || !header.node_count || size != (uint64_t)st.st_size) {
+        close(fd);
+        return -2;
+    }
+    void * base=mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) return -1;
+    const MapNode * nodes=(const MapNode *)((const char *)base+sizeof(header));
+    const MapEntry * entries=(const MapEntry *)(nodes+header.node_count);
+    *map=(MapConverter){
+        .base=base,
+        .size=size,
+        .nodes=nodes,
+        .entries=entries,
+        .units=(const UChar *)(entries+header.entry_count),
+        .node_count=header.node_count,
+        .entry_count=header.entry_count,
+        .unit_count=header.unit_count
+    };
+    return 1;
+}
+
+#ifdef ENABLE_GCONV
+/* Looks for "module CHARSET// INTERNAL FILE" in one gconv-modules file, following an alias first */
+static bool scan_gconv_modules(const char * filename, char charset[64], char * module, size_t module_size){
+    FILE * modules=fopen(filename, "r");
+    if (!modules) return false;
+    char * line=NULL;
+    size_t capacity=0;
+    bool found=false;
+    for (int pass=0; pass<2 && !found; pass++){
+        rewind(modules);
+        while (!found && getline(&line, &capacity, modules) >= 0){
+            char kind[16], from[64], to[64], file[256];
+            const int fields=sscanf(line, "%15s %63s %63s %255s", kind, from, to, file);
+            if (fields < 3 || strcasecmp(from, charset)) continue;
+            if (pass == 0 && !strcmp(kind, "alias")) {
+                strcpy(charset, to);
+                break;
+            }
+            if (fields == 4 && !strcmp(kind, "module") && !strcmp(to, "INTERNAL")) {
+                snprintf(module, module_size, "%s", file);
+                found=true;
+            }
+        }
+    }
+    free(line);
+    fclose(modules);
+    return found;
+}
+
+/* charset is given without the //, comes back as the name the module knows it by */
+static bool find_gconv_module(char charset[64], char * path, size_t path_size){
+    const char * dirs=getenv("GCONV_PATH");
+    if (!dirs) dirs=GCONV_DIRS;
+    strcat(charset, "//");
+    for (const char * dir=dirs; *dir; dir+=strcspn(dir, ":"), dir+=*dir == ':'){
+        const int dir_length=strcspn(dir, ":");
+        char filename[PATH_MAX], module[256];
+        snprintf(filename, sizeof(filename), "%.*s/gconv-modules", dir_length, dir);
+        bool found=scan_gconv_modules(filename, charset, module, sizeof(module));
+        snprintf(filename, sizeof(filename), "%.*s/gconv-modules.d", dir_length, dir);
+        DIR * conf=found?NULL:opendir(filename);
+        for (struct dirent * entry; conf && !found && (entry=readdir(conf));){
+            const size_t length=strlen(entry->d_name);
+            if (length < 5 || strcmp(entry->d_name+length-5, ".conf")) continue;
+            snprintf(filename, sizeof(filename), "%.*s/gconv-modules.d/%s", dir_length, dir, entry->d_name);
+            found=scan_gconv_modules(filename, charset, module, sizeof(module));
+        }
+        if (conf) closedir(conf);
+        if (found) {
+            if (module[0] == '/')
+                snprintf(path, path_size, "%s.so", module);
+            else
+                snprintf(path, path_size, "%.*s/%s.so", dir_length, dir, module);
+            return true;
+        }
+    }
+    return false;
+}
+
+/*
+ * codepage is a charset name from gconv-modules, or the path of a module
+ * with the charset after a colon (the file name without .so if there's
+ * none). Returns an error message on failure.
+ */
+static const char * open_gconv(const char * codepage, gconv_nonsense ** result){
+    gconv_nonsense * gconv=calloc(1, sizeof(gconv_nonsense));
+    char path[PATH_MAX];
+    const char * colon=strrchr(codepage, ':');
+    if (strchr(codepage, '/')) {
+        const int path_length=colon?colon-codepage:(int)strlen(codepage);
+        snprintf(path, sizeof(path), "%.*s", path_length, codepage);
+        if (colon)
+            snprintf(gconv->from_name, sizeof(gconv->from_name), "%s//", colon+1);
+        else {
+            const char * base=strrchr(path, '/')+1;
+            snprintf(gconv->from_name, sizeof(gconv->from_name), "%.*s//", (int)strcspn(base, "."), base);
+        }
+    } else {
+        snprintf(gconv->from_name, sizeof(gconv->from_name)-2, "%s", codepage);
+        if (!find_gconv_module(gconv->from_name, path, sizeof(path))) {
+            free(gconv);
+            return "No gconv module for %s, charsets built into glibc need --iconv\n";
+        }
+    }
+    /* glibc hands modules their names in upper case, and they compare them as such */
+    for (char * c=gconv->from_name; *c; c++) *c=toupper((unsigned char)*c);
+    gconv->shared_object=dlopen(path, RTLD_NOW);
+    if (!gconv->shared_object) {
+        free(gconv);
+        return "dlopen failed %s\n";
+    }
+    __gconv_init_fct gconv_init=dlsym(gconv->shared_object, "gconv_init");
+    gconv->gconv=dlsym(gconv->shared_object, "gconv");
+    gconv->gconv_end=dlsym(gconv->shared_object, "gconv_end");
+    if (!gconv->gconv || !gconv_init) {
+        dlclose(gconv->shared_object);
+        free(gconv);
+        return "Shared object isn't a gconv library %s\n";
+    }
+    gconv->step=(struct __gconv_step){
+        .__modname=gconv->from_name,
+        .__from_name=gconv->from_name,
+        .__to_name="INTERNAL",
+        .__fct=gconv->gconv,
+        .__init_fct=gconv_init,
+        .__end_fct=gconv->gconv_end
+    };
+    if (gconv_init(&gconv->step) != __GCONV_OK) {
+        dlclose(gconv->shared_object);
+        free(gconv);
+        return "The gconv module can't convert %s to UCS-4\n";
+    }
+    *result=gconv;
+    return NULL;
+}
+
+/*
+ * Converts length bytes in one call from state (or the initial state if
+ * it's NULL) and says how many were used. If it's the last call, whatever
+ * the module held back (TCVN waits for combining marks) is flushed.
+ * Returns the __GCONV_ result.
+ */
+static int gconv_run(const gconv_nonsense * gconv, __mbstate_t * state, const unsigned char * bytes, size_t length, bool last, uint32_t * out, size_t capacity, size_t * count, size_t * used){
+    struct __gconv_step_data step_data={
+        .__outbuf=(unsigned char *)out,
+        .__outbufend=(unsigned char *)(out+capacity),
+        .__flags=__GCONV_IS_LAST
+    };
+    step_data.__statep=state?state:&step_data.__state;
+    const unsigned char * in=bytes;
+    size_t irreversible=0;
+    /* The step is only read once it's set up, so threads can share it */
+    int status=gconv->gconv(
+        (struct __gconv_step *)&gconv->step,
+        &step_data,
+        &in,
+        bytes+length,
+        NULL,
+        &irreversible,
+        0,
+        0
+    );
+    if (last && status == __GCONV_EMPTY_INPUT && in == bytes+length && gconv->step.__stateful)
+        status=gconv->gconv(
+            (struct __gconv_step *)&gconv->step,
+            &step_data,
+            NULL,
+            NULL,
+            NULL,
+            &irreversible,
+            1,
+            0
+        );
+    *count=(uint32_t *)step_data.__outbuf-out;
+    if (used) *used=in-bytes;
+    if (status == __GCONV_EMPTY_INPUT && in != bytes+length) return __GCONV_INCOMPLETE_INPUT;
+    return status;
+}
+
+static UErrorCode gconv_error(int status){
+    switch (status){
+        case __GCONV_OK:
+        case __GCONV_EMPTY_INPUT: return U_ZERO_ERROR;
+        case __GCONV_INCOMPLETE_INPUT: return U_TRUNCATED_CHAR_FOUND;
+        case __GCONV_ILLEGAL_INPUT: return U_ILLEGAL_CHAR_FOUND;
+        case __GCONV_FULL_OUTPUT: return U_BUFFER_OVERFLOW_ERROR;
+        default: return U_INTERNAL_PROGRAM_ERROR;
+    }
+}
+
+/* UCS-4 to the cell's UTF-16 */
+static UErrorCode gconv_cell(const uint32_t * ucs4, size_t count, UChar * units, size_t * units_length){
+    int32_t length=0;
+    for (size_t i=0; i<count; i++){
+        if (ucs4[i] > 0x10ffff || length+U16_LENGTH(ucs4[i]) > 15) return U_BUFFER_OVERFLOW_ERROR;
+        U16_APPEND_UNSAFE(units, length, ucs4[i]);
+    }
+    *units_length=length;
+    return U_ZERO_ERROR;
+}
+#endif
+
+/* What every byte after the depth bytes of prefix is, each from the initial state */
+static LocaleNode * build_locale_node(locale_t locale, const unsigned char * prefix, size_t depth){
+    LocaleNode * node=calloc(1, sizeof(LocaleNode));
+    char bytes[depth+1];
+    if (depth) memcpy(bytes, prefix, depth);
+    const locale_t previous=uselocale(locale);
+    for (int i=0; i<256; i++){
+        LocaleEntry * entry=&node->entries[i];
+        mbstate_t mbstate={0};
+        bytes[depth]=i;
+        const size_t result=mbrtoc16(&entry->units[0], bytes, depth+1, &mbstate);
+        if (result == (size_t)-2) entry->kind=MAP_ENTRY_INCOMPLETE;
+        else if (result == (size_t)-1 || result == (size_t)-3) entry->kind=MAP_ENTRY_ERROR;
+        else {
+            entry->kind=MAP_ENTRY_CHARACTER;
+            entry->length=1;
+            /* The low surrogate needs one more call */
+            if (U16_IS_LEAD(entry->units[0]) && mbrtoc16(&entry->units[1], bytes, 0, &mbstate) == (size_t)-3)
+                entry->length=2;
+        }
+    }
+    uselocale(previous);
+    return node;
+}
+
+static void free_locale_node(LocaleNode * node){
+    if (!node) return;
+    for (int i=0; i<256; i++)
+        free_locale_node(atomic_load_explicit(&node->entries[i].next, memory_order_relaxed));
+    free(node);
+}
+
+/* Opens config->codepage with config->backend, returns an error message on failure */
+static const char * open_converter(Config * config){
+    const char * errmsg;
+    err=U_ZERO_ERROR;
+    switch (config->backend){
+        case ICU:
+            if (config->data_file) 
+                config->converter=ucnv_openPackage(
+                    config->data_file,
+                    config->codepage,
+                    &err
+                );
+            else
+                config->converter=ucnv_open(
+                    config->codepage,
+                    &err
+                );
+            if (U_SUCCESS(err)) ucnv_setToUCallBack(
+                config->converter,
+                UCNV_TO_U_CALLBACK_STOP,
+                NULL,
+                NULL,
+                NULL,
+                &idc
+            ); else {
+                config->fail=true;
+                errmsg="No such codepage %s\n";
+                return errmsg;
+            }
+        break;
+        #ifdef ENABLE_ICONV
+        case ICONV: {
+            config->converter=iconv_open(
+                utf16_host_endian(),
+                config->codepage
+            );
+            if (config->converter==(void *)-1){
+                config->fail=true;
+                errmsg="No such codepage %s\n";
+                return errmsg;
+            }
+            
+        } break;
+        #endif 
+
+        case LOCALE:{
+            const locale_t locale=newlocale(LC_CTYPE_MASK, config->codepage, (locale_t)0);
+            if (locale == (locale_t)0) {
+                errmsg="No such locale %s\n";
+                config->fail=true;
+                return errmsg;
+            }
+            LocaleConverter * converter=malloc(sizeof(LocaleConverter));
+            converter->locale=locale;
+            converter->root=build_locale_node(locale, NULL, 0);
+            config->converter=converter;
+        } break;
+        #ifdef ENABLE_GCONV
+        case GCONV:{
+            gconv_nonsense * gconv;
+            errmsg=open_gconv(config->codepage, &gconv);
+            if (errmsg) {
+                config->fail=true;
+                return errmsg;
+            }
+            config->converter=gconv;
+        }
+        break;
+        #endif
+        #ifdef ENABLE_LIBICONV
+        case LIBICONV: {
+            config->converter=libiconv_open(
+                utf16_host_endian(),
+                config->codepage
+            );
+            if (config->converter==(void *)-1){
+                config->fail=true;
+                errmsg="No such codepage %s\n";
+                return errmsg;
+            }
+            
+        } break;
+        #endif
+        case MAPPING_FILE: {
+            MapConverter * map=calloc(1, sizeof(MapConverter));
+            config->converter=map;
+            const int image=open_map_image(config->codepage, map);
+            if (image < 0) {
+                errmsg=image == -1?"No such file %s\n":"Broken mapping image %s\n";
+                config->fail=true;
+                return errmsg;
+            }
+            if (image) break;
+            #ifdef ENABLE_MAPFILE
+            FILE * mapping_file=fopen(config->codepage, "rt");
+            if (!mapping_file) {
+                errmsg="No such file %s\n";
+                config->fail=true;
+                return errmsg;
+            }
+                
+            map->table=parse_mapping_file(mapping_file);
+            fclose(mapping_file);
+            if (!map->table.table){
+                config->fail=true;
+                errmsg="Invalid mapping file %s\n";
+                return errmsg;
+            }
+            #else
+            errmsg="%s isn't a mapping image, text mapping files need ENABLE_MAPFILE\n";
+            config->fail=true;
+            return errmsg;
+            #endif
+        } break;
+        default:
+        break;
+    }
+    return NULL;
+}
+
+#ifndef CPDISP_LIBRARY
+/* Long options without a short form */
+enum {
+    OPT_CACHE=256,
+    OPT_SKIP_DEAD,
+    OPT_SHOW_DEAD,
+    OPT_EXPLORE,
+    OPT_REVERSE,
+    OPT_ALL,
+    OPT_LIST,
+    OPT_DIFF,
+    OPT_FORMAT,
+    OPT_NAMES,
+    OPT_HEATMAP,
+    OPT_VALIDATE,
+    OPT_DETECT,
+    OPT_BENCHMARK,
+    OPT_STATS,
+    OPT_COMPILE_MAP,
+    OPT_STATEFUL
+};
+
+/* U+XXXX, 0xXXXX or plain hex */
+static UChar32 parse_codepoint(const char * str, const char ** end){
+    if ((str[0]=='U' || str[0]=='u') && str[1]=='+') str+=2;
+    return strtol(str, (char **)end, 16);
+}
+
 Config CreateConfig(int argc, char * argv[], inbuf_type * inbuf){
     Config config={
         .no_format_bool=false,
@@ -231,14 +1146,16 @@ Config CreateConfig(int argc, char * argv[], inbuf_type * inbuf){
         .fail=false,
         .help=false,
         .control_codes_raw=false,
-        .verbose_control_codes_and_whitespace=false
+        .verbose_control_codes_and_whitespace=false,
+        .jobs=1,
+        .output_fd=STDOUT_FILENO
     };
     int opt;
     char * dat_filename=NULL;
     int from_table=0, to_table=255;
     static int backend;
     backend=ICU;
-    static const char optstring[] = "wNhnd:x:r:i2cz";
+    static const char optstring[] = "wNhnd:x:r:i2czj:o:";
     static const struct option longopts[] = {
         {"help", 0, NULL, 'h'},
         {"wide", 0, NULL, 'w'},
@@ -246,18 +1163,37 @@ Config CreateConfig(int argc, char * argv[], inbuf_type * inbuf){
         {"no-format", 0, NULL, 'n'},
         {"raw", 0, NULL, 'N'},
         {"column-order", 0, NULL, 'z'},
+        {"jobs", 1, NULL, 'j'},
         #ifdef ENABLE_ICONV
         {"iconv", 0, &backend, ICONV},
         #endif 
         #ifdef ENABLE_LIBICONV
         {"libiconv", 0, &backend, LIBICONV},
         #endif 
-        #ifdef ENABLE_MAPFILE
         {"mapfile", 0, &backend, MAPPING_FILE},
+        #ifdef ENABLE_GCONV
+        {"gconv", 0, &backend, GCONV},
         #endif
-        //{"gconv", 0, &backend, GCONV},
         {"locale", 0, &backend, LOCALE},
         {"icu", 0, &backend, ICU},
+        {"cache", 2, NULL, OPT_CACHE},
+        {"skip-dead", 0, NULL, OPT_SKIP_DEAD},
+        {"show-dead", 0, NULL, OPT_SHOW_DEAD},
+        {"explore", 2, NULL, OPT_EXPLORE},
+        {"reverse", 2, NULL, OPT_REVERSE},
+        {"all", 0, NULL, OPT_ALL},
+        {"list", 1, NULL, OPT_LIST},
+        {"output", 1, NULL, 'o'},
+        {"diff", 1, NULL, OPT_DIFF},
+        {"format", 1, NULL, OPT_FORMAT},
+        {"names", 0, NULL, OPT_NAMES},
+        {"heatmap", 1, NULL, OPT_HEATMAP},
+        {"validate", 1, NULL, OPT_VALIDATE},
+        {"detect", 1, NULL, OPT_DETECT},
+        {"benchmark", 2, NULL, OPT_BENCHMARK},
+        {"stats", 2, NULL, OPT_STATS},
+        {"compile-map", 1, NULL, OPT_COMPILE_MAP},
+        {"stateful", 2, NULL, OPT_STATEFUL},
         {0}
     };
     while ((opt=getopt_long(argc, argv, optstring,longopts,NULL))!=-1){
@@ -318,6 +1254,90 @@ Config CreateConfig(int argc, char * argv[], inbuf_type * inbuf){
             case 'z':
             config.column_order = true;
             break;
+            case OPT_CACHE:
+            config.cache_dir=optarg?optarg:"";
+            break;
+            case OPT_SKIP_DEAD:
+            config.skip_dead=true;
+            break;
+            case OPT_SHOW_DEAD:
+            config.show_dead=true;
+            break;
+            case OPT_EXPLORE:{
+            int depth=optarg?atoi(optarg):4;
+            config.explore_depth=depth<1?1:depth>16?16:depth;
+            } break;
+            case OPT_STATEFUL:{
+            int depth=optarg?atoi(optarg):4;
+            config.stateful_depth=depth<1?1:depth>16?16:depth;
+            } break;
+            case OPT_ALL:
+            config.all=true;
+            break;
+            case OPT_LIST:
+            config.list_file=optarg;
+            break;
+            case 'o':
+            config.output_dir=optarg;
+            break;
+            case OPT_DIFF:
+            config.diff_target=optarg;
+            break;
+            case OPT_FORMAT:{
+            int output_format=FORMAT_ANSI;
+            while (output_format <= FORMAT_BINARY && strcmp(optarg, format_names[output_format])) output_format++;
+            if (output_format > FORMAT_BINARY) {
+                fprintf(stderr,"Unknown format %s\n", optarg);
+                config.fail=true;
+                return config;
+            }
+            config.output_format=output_format;
+            } break;
+            case OPT_NAMES:
+            config.names=true;
+            break;
+            case OPT_HEATMAP:
+            config.heatmap_file=optarg;
+            break;
+            case OPT_VALIDATE:
+            config.validate_file=optarg;
+            break;
+            case OPT_DETECT:
+            config.detect_file=optarg;
+            break;
+            case OPT_COMPILE_MAP:
+            config.map_image_file=optarg;
+            break;
+            case OPT_STATS:
+            config.stats=true;
+            config.stats_file=optarg;
+            break;
+            case OPT_BENCHMARK:{
+            int runs=optarg?atoi(optarg):3;
+            config.benchmark_runs=runs<1?1:runs>255?255:runs;
+            } break;
+            case OPT_REVERSE:{
+            config.reverse=true;
+            config.reverse_from=0;
+            config.reverse_to=0x10ffff;
+            if (!optarg) break;
+            const char * end;
+            config.reverse_from=parse_codepoint(optarg, &end);
+            config.reverse_to=*end==':'?parse_codepoint(end+1, &end):config.reverse_from;
+            if (
+                config.reverse_from < 0 || config.reverse_to > 0x10ffff ||
+                config.reverse_to < config.reverse_from
+            ) {
+                fprintf(stderr,"Bad code point range %s\n", optarg);
+                config.fail=true;
+                return config;
+            }
+            } break;
+            case 'j':{
+            int jobs=atoi(optarg);
+            if (jobs <= 0) jobs=sysconf(_SC_NPROCESSORS_ONLN);
+            config.jobs=jobs>256?256:jobs;
+            } break;
             case '?':
             default:
             fprintf(stderr,"Unknown Option %c\n",opt);
@@ -328,15 +1348,15 @@ Config CreateConfig(int argc, char * argv[], inbuf_type * inbuf){
         }
     }
     config.backend=backend;
-    if (argc < optind+1){
+    if (argc < optind+1 && !config.all && !config.list_file && !config.detect_file && !config.benchmark_runs){
         fprintf(stderr,"No codepage given\n");
         config.fail=true;
         return config;
     }
-    if (!config.wide){
+    if (!config.wide)
         to_table=from_table=0;
+    if (config.output_format != FORMAT_ANSI)
         config.interactive=false;
-    }
     if (
         from_table >= 256 || to_table >= 256 ||
         from_table < 0 || to_table < 0
@@ -349,423 +1369,4380 @@ Config CreateConfig(int argc, char * argv[], inbuf_type * inbuf){
         config.fail=true;
         return config;
     }
+    if (config.reverse && (
+        backend == MAPPING_FILE
+        #ifdef ENABLE_GCONV
+        || backend == GCONV
+        #endif
+    )){
+        fprintf(stderr,"--reverse isn't supported with --mapfile or --gconv\n");
+        config.fail=true;
+        return config;
+    }
     config.from_table=from_table;
     config.to_table=to_table;
-    const char * errmsg;
-    switch (backend){
-        case ICU:
-            if (dat_filename) 
-                config.converter=ucnv_openPackage(
-                    dat_filename,
-                    argv[optind],
-                    &err
-                );
-            else
-                config.converter=ucnv_open(
-                    argv[optind],
-                    &err
-                );
-            if (U_SUCCESS(err)) ucnv_setToUCallBack(
-                config.converter,
-                UCNV_TO_U_CALLBACK_STOP,
-                NULL,
-                NULL,
-                NULL,
-                &idc
-            ); else {
-                config.fail=true;
-                errmsg="No such codepage %s\n";
-                goto end;
-            }
-        break;
-        #ifdef ENABLE_ICONV
-        case ICONV: {
-            /* Silly endianess hack */
-            union {
-                char is_little_endian:8;
-                UChar32 a;
-            } e={.a=1};
-            config.converter=iconv_open(
-                e.is_little_endian?"UTF-16LE":"UTF-16BE",
-                argv[optind]
-            );
-            if (config.converter==(void *)-1){
-                config.fail=true;
-                errmsg="No such codepage %s\n";
-                goto end;
-            }
-            
-        } break;
-        #endif 
+    config.codepage=argv[optind];
+    config.data_file=dat_filename;
+    if (config.all || config.list_file || config.detect_file || config.benchmark_runs) return config;
+    current_stats=config.stats?&stats_setup:NULL;
+    const uint64_t start=stats_begin();
+    const char * errmsg=open_converter(&config);
+    stats_end(PHASE_OPEN, start);
+    current_stats=NULL;
+    if (errmsg)
+        fprintf(stderr,errmsg, config.codepage);
+    return config;
+}
+#endif
+
+typedef struct {
+    UChar str_utf16[15];
+    uint8_t length_utf16;
+    UErrorCode err;
+    /* Filled by classify_cell */
+    uint8_t flags, first_flags;
+    int8_t control, whitespace;
+    bool wide : 1;
+    bool wide_with_circle : 1;
+} Cell;
+
+/*
+ * One pass over the cell's code points: flags of every code point ORed
+ * together, flags of the first one, where the first control and the first
+ * whitespace character are, and whether it takes two columns both as is
+ * and with a dotted circle in front.
+ */
+static void classify_cell(Cell * cell){
+    const UChar * str=cell->str_utf16;
+    const int32_t length=cell->length_utf16;
+    int width=0, width_with_circle=1;
+    cell->flags=cell->first_flags=0;
+    cell->control=cell->whitespace=-1;
+    cell->wide=cell->wide_with_circle=false;
+    for (int32_t i=0; i<length;){
+        const int32_t start=i;
+        UChar32 c;
+        U16_NEXT(str, i, length, c);
+        const uint8_t flags=cp_flags(c);
+        if (start==0) cell->first_flags=flags;
+        cell->flags|=flags;
+        if ((flags & CP_CONTROL) && cell->control < 0) cell->control=start;
+        if ((flags & CP_WHITESPACE) && cell->whitespace < 0) cell->whitespace=start;
+        if (!(flags & CP_NONSPACING) || c==0xfe0f){
+            if (width == 1 || (flags & CP_WIDE)) cell->wide=true;
+            else width+=1;
+            if (width_with_circle == 1 || (flags & CP_WIDE)) cell->wide_with_circle=true;
+            else width_with_circle+=1;
+        }
+    }
+}
+
+/*
+ * One walk down the trie per character, returns what convert_cell would.
+ * Starts from *node and leaves the node it stopped in there, which is
+ * how far into a character the bytes end.
+ */
+static UErrorCode convert_map_image(const MapConverter * map, uint32_t * node_state, const unsigned char * bytes, size_t length, UChar * units, size_t * units_length){
+    uint32_t node=*node_state;
+    *units_length=0;
+    for (size_t i=0; i<length; i++){
+        if (node >= map->node_count) return U_INVALID_FORMAT_ERROR;
+        const MapNode * current=&map->nodes[node];
+        if (bytes[i] < current->first || bytes[i] > current->last) return current->outside;
+        const uint64_t index=(uint64_t)current->entries+bytes[i]-current->first;
+        if (index >= map->entry_count) return U_INVALID_FORMAT_ERROR;
+        const MapEntry * entry=&map->entries[index];
+        switch (entry->kind){
+            case MAP_ENTRY_CHARACTER:
+                if ((uint64_t)entry->value+entry->length > map->unit_count) return U_INVALID_FORMAT_ERROR;
+                if (*units_length+entry->length > 15) return U_STANDARD_ERROR_LIMIT;
+                memcpy(units+*units_length, map->units+entry->value, entry->length*sizeof(UChar));
+                *units_length+=entry->length;
+                node=0;
+            break;
+            case MAP_ENTRY_INCOMPLETE:
+                node=entry->value;
+                if (node == UINT32_MAX && i+1 < length) return U_ILLEGAL_CHAR_FOUND;
+            break;
+            default:
+                return (UErrorCode)entry->value;
+        }
+    }
+    *node_state=node;
+    return node?U_TRUNCATED_CHAR_FOUND:U_ZERO_ERROR;
+}
+
+/* mbrtoc16 from mbstate, which keeps an incomplete character at the end */
+static UErrorCode convert_locale(locale_t locale, const char * bytes, size_t length, mbstate_t * mbstate, UChar * units, size_t * units_length){
+    const locale_t previous=uselocale(locale);
+    size_t bytes_converted=0, length_utf16=0;
+    UErrorCode err=U_ZERO_ERROR;
+    bool done=false;
+    while (!done && bytes_converted<length && length_utf16<15){
+        size_t result=mbrtoc16(
+            &units[length_utf16],
+            &bytes[bytes_converted],
+            length-bytes_converted,
+            mbstate
+        );
+        switch (result){
+            case -3:
+                length_utf16++;
+            break;
+            case -2:
+                err=U_TRUNCATED_CHAR_FOUND;
+                done=true;
+            break;
+            case -1:
+                err=U_ILLEGAL_CHAR_FOUND;
+                done=true;
+            break;
+            case 0:
+                result=1;
+                /* fall through */
+            default:
+                length_utf16++;
+                bytes_converted+=result;
+            break;
+
+
+        }
+    }
+    if (!done && bytes_converted<length) {
+        err=U_BUFFER_OVERFLOW_ERROR;
+        done=true;
+    }
+    /* The low surrogate of the last character needs one more call */
+    if (
+        !done && length_utf16 && length_utf16 < 15 &&
+        U16_IS_LEAD(units[length_utf16-1]) &&
+        mbrtoc16(&units[length_utf16], &bytes[bytes_converted], 0, mbstate) == (size_t)-3
+    )
+        length_utf16++;
+    uselocale(previous);
+    *units_length=length_utf16;
+    return err;
+}
+
+static LocaleNode * locale_child(const LocaleConverter * converter, LocaleEntry * entry, const unsigned char * prefix, size_t depth){
+    LocaleNode * node=atomic_load_explicit(&entry->next, memory_order_acquire);
+    if (node) return node;
+    node=build_locale_node(converter->locale, prefix, depth);
+    LocaleNode * expected=NULL;
+    /* Another thread may have beaten us to it */
+    if (!atomic_compare_exchange_strong(&entry->next, &expected, node)){
+        free(node);
+        return expected;
+    }
+    return node;
+}
+
+/* convert_locale from the initial state, one trie lookup per byte */
+static UErrorCode convert_locale_trie(const LocaleConverter * converter, const unsigned char * bytes, size_t length, UChar * units, size_t * units_length){
+    LocaleNode * node=converter->root;
+    size_t start=0;
+    *units_length=0;
+    for (size_t i=0; i<length; i++){
+        LocaleEntry * entry=&node->entries[bytes[i]];
+        switch (entry->kind){
+            case MAP_ENTRY_CHARACTER:
+                if (*units_length+entry->length > 15) return U_BUFFER_OVERFLOW_ERROR;
+                memcpy(units+*units_length, entry->units, entry->length*sizeof(UChar));
+                *units_length+=entry->length;
+                node=converter->root;
+                start=i+1;
+            break;
+            case MAP_ENTRY_INCOMPLETE:
+                if (i+1 == length) return U_TRUNCATED_CHAR_FOUND;
+                if (i+1-start >= MB_LEN_MAX) return U_ILLEGAL_CHAR_FOUND;
+                node=locale_child(converter, entry, bytes+start, i+1-start);
+            break;
+            default:
+                return U_ILLEGAL_CHAR_FOUND;
+        }
+    }
+    return U_ZERO_ERROR;
+}
+
+static void convert_cell(const Config config, char * bytes, size_t length, Cell * cell){
+    UChar* str_utf16_ptr=cell->str_utf16;
+    size_t length_utf16=0;
+    UErrorCode err=U_ZERO_ERROR;
+    switch(config.backend){
+
+        #ifdef ENABLE_ICONV
+        case ICONV: {
+            size_t inbytes_left=length;
+            size_t outbytes_left=15*sizeof(UChar);
+            char * inbuf_ptr=bytes;
+            UChar* str_utf16_ptr_bak=str_utf16_ptr;
+
+            size_t result=iconv(
+                config.converter,
+                &inbuf_ptr,
+                &inbytes_left,
+                (char**)&str_utf16_ptr_bak,
+                &outbytes_left
+            );
+            length_utf16=15-outbytes_left/sizeof(UChar);
+
+            if(result == (size_t) -1 ){
+                if (errno == EINVAL) err=U_TRUNCATED_CHAR_FOUND;
+                else if (errno == EILSEQ) err=U_ILLEGAL_CHAR_FOUND;
+                else err=U_STANDARD_ERROR_LIMIT;
+                /* Resume the next cell from the initial shift state */
+                iconv(config.converter, NULL, NULL, NULL, NULL);
+            }
+                else err=U_ZERO_ERROR;
+        }
+        break;
+        #endif
+        #ifdef ENABLE_LIBICONV
+        case LIBICONV: {
+            size_t inbytes_left=length;
+            size_t outbytes_left=15*sizeof(UChar);
+            char * inbuf_ptr=bytes;
+            UChar* str_utf16_ptr_bak=str_utf16_ptr;
+
+            size_t result=libiconv(
+                config.converter,
+                &inbuf_ptr,
+                &inbytes_left,
+                (char**)&str_utf16_ptr_bak,
+                &outbytes_left
+            );
+            length_utf16=15-outbytes_left/sizeof(UChar);
+
+            if(result == (size_t) -1 ){
+                if (errno == EINVAL) err=U_TRUNCATED_CHAR_FOUND;
+                else if (errno == EILSEQ) err=U_ILLEGAL_CHAR_FOUND;
+                else err=U_STANDARD_ERROR_LIMIT;
+                libiconv(config.converter, NULL, NULL, NULL, NULL);
+            }
+                else err=U_ZERO_ERROR;
+        }
+        break;
+        #endif
+        case ICU:
+            err=U_ZERO_ERROR;
+            length_utf16=ucnv_toUChars (
+                config.converter,
+                str_utf16_ptr,
+                15,
+                bytes,
+                length,
+                &err
+            );
+        break;
+        case LOCALE:
+            err=convert_locale_trie(config.converter, (const unsigned char *)bytes, length, str_utf16_ptr, &length_utf16);
+        break;
+        #ifdef ENABLE_GCONV
+        case GCONV: {
+            uint32_t ucs4[16];
+            size_t count;
+            err=gconv_error(gconv_run(config.converter, NULL, (const unsigned char *)bytes, length, true, ucs4, 16, &count, NULL));
+            if (U_SUCCESS(err)) err=gconv_cell(ucs4, count, str_utf16_ptr, &length_utf16);
+        } break;
+        #endif
+        case MAPPING_FILE:{
+            const MapConverter * map=config.converter;
+            if (map->base) {
+                err=convert_map_image(map, &(uint32_t){0}, (const unsigned char *)bytes, length, str_utf16_ptr, &length_utf16);
+                break;
+            }
+            #ifdef ENABLE_MAPFILE
+            char out_buf_utf8[31];
+            size_t outlen;
+            convert_result r=convert(
+                map->table,
+                bytes,
+                length,
+                out_buf_utf8,
+                31,
+                &outlen
+            );
+            if (r==CONVERSION_OK){
+                int32_t length_utf16_i;
+                err=U_ZERO_ERROR;
+                u_strFromUTF8(
+                    str_utf16_ptr,
+                    15,
+                    &length_utf16_i,
+                    out_buf_utf8,
+                    outlen,
+                    &err
+                );
+                length_utf16=length_utf16_i;
+            } else {
+                static const UErrorCode error_conversion[]={
+                    [CONVERSION_OK]=U_ZERO_ERROR,
+                    [INVALID_CHARACTER]=U_ILLEGAL_CHAR_FOUND,
+                    [INCOMPLETE_CHARACTER]=U_TRUNCATED_CHAR_FOUND,
+                    [BUFFER_NOT_BIG_ENOUGH]=U_STANDARD_ERROR_LIMIT
+                };
+                err=error_conversion[r];
+                length_utf16=0;
+            }
+            #endif
+        } break;
+        /* Backend not compiled into the binary */
+        default:
+            err=U_UNSUPPORTED_ERROR;
+    }
+    cell->length_utf16=length_utf16;
+    cell->err=err;
+}
+
+static UConverter * icu_clone(const UConverter * converter){
+    UErrorCode err=U_ZERO_ERROR;
+    #if U_ICU_VERSION_MAJOR_NUM >= 71
+    UConverter * clone=ucnv_clone(converter, &err);
+    #else
+    UConverter * clone=ucnv_safeClone(converter, NULL, NULL, &err);
+    #endif
+    return U_SUCCESS(err)?clone:NULL;
+}
+
+/*
+ * --stateful: the prefix is converted once and every cell starts from a
+ * copy of the state the converter was left in, instead of from the
+ * initial state with the prefix in front of it. ICU converters are
+ * cloned, mbstate_t and gconv states are copied (with the bytes of an
+ * incomplete character for gconv) and a mapping image's state is the trie
+ * node it's in. iconv can't hand its state out, so it keeps the bytes
+ * that led there and they're replayed for every cell.
+ */
+typedef struct ConverterState {
+    UConverter * icu;
+    mbstate_t mbstate;
+    #ifdef ENABLE_GCONV
+    __mbstate_t gconv;
+    #endif
+    uint32_t node;
+    char * history;
+    size_t history_length;
+} ConverterState;
+
+#if defined(ENABLE_ICONV) || defined(ENABLE_LIBICONV)
+typedef size_t (*iconv_function)(void *, char **, size_t *, char **, size_t *);
+static UErrorCode iconv_replay(iconv_function convert, void * cd, ConverterState * state, const char * bytes, size_t length, bool last, UChar * units, size_t * units_length){
+    UChar scratch[64];
+    char * in=state->history;
+    size_t in_left=state->history_length;
+    convert(cd, NULL, NULL, NULL, NULL);
+    while (in_left) {
+        char * out=(char *)scratch;
+        size_t out_left=sizeof(scratch);
+        if (convert(cd, &in, &in_left, &out, &out_left) != (size_t)-1 || errno != E2BIG) break;
+    }
+    /* iconv leaves an incomplete character at the end of the history unread */
+    char input[in_left+length+1];
+    memcpy(input, in, in_left);
+    memcpy(input+in_left, bytes, length);
+    in=input;
+    in_left+=length;
+    char * out=(char *)units;
+    size_t out_left=15*sizeof(UChar);
+    UErrorCode err=U_ZERO_ERROR;
+    if (
+        convert(cd, &in, &in_left, &out, &out_left) == (size_t)-1 ||
+        (last && convert(cd, NULL, NULL, &out, &out_left) == (size_t)-1)
+    ) {
+        if (errno == EINVAL) err=U_TRUNCATED_CHAR_FOUND;
+        else if (errno == EILSEQ) err=U_ILLEGAL_CHAR_FOUND;
+        else err=U_STANDARD_ERROR_LIMIT;
+    }
+    *units_length=15-out_left/sizeof(UChar);
+    if (!last && (U_SUCCESS(err) || err == U_TRUNCATED_CHAR_FOUND)) {
+        state->history=realloc(state->history, state->history_length+length);
+        memcpy(state->history+state->history_length, bytes, length);
+        state->history_length+=length;
+    }
+    return err;
+}
+#endif
+
+/*
+ * Converts bytes from state and leaves the state where they end.
+ * Unless it's the last call, ending inside a character is
+ * U_TRUNCATED_CHAR_FOUND with the character kept for the next call.
+ */
+static UErrorCode state_feed(const Config config, ConverterState * state, const char * bytes, size_t length, bool last, UChar * units, size_t * units_length){
+    UErrorCode err=U_ZERO_ERROR;
+    *units_length=0;
+    switch (config.backend){
+        case ICU: {
+            UChar * target=units;
+            const char * source=bytes;
+            ucnv_toUnicode(state->icu, &target, units+15, &source, bytes+length, NULL, last, &err);
+            *units_length=target-units;
+            if (U_SUCCESS(err) && !last && ucnv_toUCountPending(state->icu, &idc) > 0)
+                err=U_TRUNCATED_CHAR_FOUND;
+            idc=U_ZERO_ERROR;
+        } break;
+        #ifdef ENABLE_ICONV
+        case ICONV:
+            err=iconv_replay((iconv_function)iconv, config.converter, state, bytes, length, last, units, units_length);
+        break;
+        #endif
+        #ifdef ENABLE_LIBICONV
+        case LIBICONV:
+            err=iconv_replay((iconv_function)libiconv, config.converter, state, bytes, length, last, units, units_length);
+        break;
+        #endif
+        case LOCALE:
+            err=convert_locale(((const LocaleConverter *)config.converter)->locale, bytes, length, &state->mbstate, units, units_length);
+        break;
+        #ifdef ENABLE_GCONV
+        case GCONV: {
+            /* Modules can't all keep half a character in their state, so it's kept in the history */
+            unsigned char input[state->history_length+length+1];
+            memcpy(input, state->history, state->history_length);
+            memcpy(input+state->history_length, bytes, length);
+            uint32_t ucs4[16];
+            size_t count, used;
+            err=gconv_error(gconv_run(config.converter, &state->gconv, input, sizeof(input)-1, last, ucs4, 16, &count, &used));
+            if (err == U_TRUNCATED_CHAR_FOUND && !last) {
+                state->history=realloc(state->history, sizeof(input)-1-used);
+                memcpy(state->history, input+used, sizeof(input)-1-used);
+                state->history_length=sizeof(input)-1-used;
+            } else if (!last) state->history_length=0;
+            if (U_SUCCESS(err) || err == U_TRUNCATED_CHAR_FOUND) {
+                const UErrorCode cell_err=gconv_cell(ucs4, count, units, units_length);
+                if (U_FAILURE(cell_err)) err=cell_err;
+            }
+        } break;
+        #endif
+        case MAPPING_FILE:
+            err=convert_map_image(config.converter, &state->node, (const unsigned char *)bytes, length, units, units_length);
+        break;
+        default:
+            err=U_UNSUPPORTED_ERROR;
+    }
+    return err;
+}
+
+#ifndef CPDISP_LIBRARY
+static bool state_copy(const ConverterState * from, ConverterState * to){
+    *to=*from;
+    to->history=NULL;
+    if (from->icu && !(to->icu=icu_clone(from->icu))) return false;
+    if (from->history_length) {
+        to->history=malloc(from->history_length);
+        memcpy(to->history, from->history, from->history_length);
+    }
+    return true;
+}
+
+static void state_close(ConverterState * state){
+    if (state->icu) ucnv_close(state->icu);
+    free(state->history);
+    *state=(ConverterState){0};
+}
+
+/* The state the converter is in after the prefix, false if the prefix has an error in it */
+static bool state_open(const Config config, const inbuf_type * prefix, ConverterState * state){
+    *state=(ConverterState){0};
+    if (config.backend == ICU) {
+        state->icu=icu_clone(config.converter);
+        if (!state->icu) return false;
+        ucnv_resetToUnicode(state->icu);
+    }
+    if (config.backend == MAPPING_FILE && !((const MapConverter *)config.converter)->base)
+        return false;
+    /* A byte at a time, so no character of it overflows the units */
+    for (size_t i=0; i<prefix->index; i++){
+        UChar units[15];
+        size_t units_length;
+        const UErrorCode err=state_feed(config, state, &prefix->buf[i], 1, false, units, &units_length);
+        if (U_FAILURE(err) && err != U_TRUNCATED_CHAR_FOUND) {
+            state_close(state);
+            return false;
+        }
+    }
+    return true;
+}
+#endif
+
+/* A cell from a copy of state, which is left as it was */
+static void state_convert_cell(const Config config, const ConverterState * state, const char * bytes, size_t length, Cell * cell){
+    /* The last call doesn't add to the history, so only ICU needs a real copy */
+    ConverterState fork=*state;
+    size_t length_utf16=0;
+    if (state->icu && !(fork.icu=icu_clone(state->icu))) {
+        cell->err=U_MEMORY_ALLOCATION_ERROR;
+        return;
+    }
+    cell->err=state_feed(config, &fork, bytes, length, true, cell->str_utf16, &length_utf16);
+    cell->length_utf16=length_utf16;
+    if (fork.icu) ucnv_close(fork.icu);
+}
+
+/*
+ * Converters that keep no state between characters and don't eat a BOM,
+ * so converting all cells back to back gives the same answer as
+ * converting them one at a time. SBCS tables with multibyte extensions
+ * (gsm-03.38) report offsets that lag behind the input, so they're out too.
+ */
+static bool icu_batchable(const UConverter * converter){
+    switch (ucnv_getType(converter)){
+        case UCNV_SBCS:
+            return ucnv_getMaxCharSize(converter)==1;
+        case UCNV_UTF16_BigEndian:
+        case UCNV_UTF16_LittleEndian:
+            if (strstr(ucnv_getName(converter, &idc), "version=")) return false;
+            /* fall through */
+        case UCNV_DBCS:
+        case UCNV_MBCS:
+        case UCNV_LATIN_1:
+        case UCNV_US_ASCII:
+        case UCNV_UTF8:
+        case UCNV_CESU8:
+        case UCNV_UTF32_BigEndian:
+        case UCNV_UTF32_LittleEndian:
+            return true;
+        default:
+            return false;
+    }
+}
+
+/*
+ * Convert the whole table with as few ucnv_toUnicode calls as possible.
+ * All 256 byte sequences are laid out back to back and the offsets array
+ * tells which cell every UChar came from. A cell is only taken from the
+ * batch if a character starts exactly at its first byte and the next
+ * character (or the error) starts exactly at the next cell, anything
+ * straddling a boundary is redone with convert_cell.
+ * The converter may look past a cell before deciding a sequence is
+ * illegal, so cells with errors are always redone on their own and the
+ * batch resumes after the next cell that converts cleanly.
+ */
+static void convert_table_icu(
+    const Config config,
+    char * src,
+    const int32_t starts[257],
+    Cell cells[256]
+){
+    enum {units_capacity=256*16};
+    UChar units[units_capacity];
+    int32_t offsets[units_capacity];
+    bool done[256]={0};
+    const int32_t cell_length=starts[1];
+    int resume=0;
+    while (resume < 256){
+        UErrorCode err=U_ZERO_ERROR;
+        UChar * target=units;
+        const char * source=src+starts[resume];
+        ucnv_resetToUnicode(config.converter);
+        ucnv_toUnicode(
+            config.converter,
+            &target,
+            units+units_capacity,
+            &source,
+            src+starts[256],
+            offsets,
+            true,
+            &err
+        );
+        const int32_t length=target-units;
+        const int32_t stop=source-src;
+        int32_t error_start=-1;
+        if (U_FAILURE(err) && err != U_BUFFER_OVERFLOW_ERROR){
+            char invalid[32];
+            int8_t invalid_length=sizeof(invalid);
+            ucnv_getInvalidChars(config.converter, invalid, &invalid_length, &idc);
+            idc=U_ZERO_ERROR;
+            if (invalid_length > 0) error_start=stop-invalid_length;
+        }
+
+        const int32_t base=starts[resume];
+        int32_t u=0;
+        for (int cell=resume; cell < 256 && starts[cell] < stop; cell++){
+            const int32_t begin=starts[cell], end=starts[cell+1];
+            const int32_t first=u;
+            while (u<length && offsets[u]+base < end) u++;
+            if (!(cell==resume || (first<u && offsets[first]+base==begin)))
+                continue;
+            if (first==u || u-first > 15) continue;
+            if (u<length) {
+                if (offsets[u]+base != end) continue;
+            } else if (U_SUCCESS(err)) {
+                if (cell != 255) continue;
+            } else if (error_start != end) continue;
+
+            memcpy(cells[cell].str_utf16, &units[first], (u-first)*sizeof(UChar));
+            cells[cell].length_utf16=u-first;
+            cells[cell].err=U_ZERO_ERROR;
+            done[cell]=true;
+        }
+        if (U_SUCCESS(err)) break;
+
+        int cell=resume;
+        for (; cell < 256 && starts[cell] < stop; cell++)
+            if (!done[cell]) {
+                convert_cell(config, src+starts[cell], cell_length, &cells[cell]);
+                done[cell]=true;
+            }
+        /* Stopped before the first byte of the batch, take that cell on its own so the batch moves on */
+        if (cell == resume) {
+            if (!done[cell]) convert_cell(config, src+starts[cell], cell_length, &cells[cell]);
+            done[cell++]=true;
+        }
+        while (cell < 256 && U_FAILURE(cells[cell-1].err)) {
+            convert_cell(config, src+starts[cell], cell_length, &cells[cell]);
+            done[cell++]=true;
+        }
+        resume=cell;
+    }
+    for (int cell=0; cell<256; cell++)
+        if (!done[cell]) convert_cell(config, src+starts[cell], starts[cell+1]-starts[cell], &cells[cell]);
+}
+
+/* Fill cells[byte] with the conversion of prefix+table+byte (or prefix+byte) */
+#ifdef ENABLE_GCONV
+/*
+ * The whole table in one call to the module. gconv doesn't say which
+ * input made which output, so every cell is followed by a sentinel, a
+ * byte that's a character of its own and isn't in the bytes all cells
+ * start with, and its code point in the output ends the cell's
+ * characters. The cell that is the sentinel is converted on its own. If
+ * anything failed or the sentinels don't come out one per cell, it's all
+ * left to convert_cell.
+ */
+static bool convert_table_gconv(const Config config, char * src, const int32_t starts[257], Cell cells[256]){
+    const gconv_nonsense * gconv=config.converter;
+    if (gconv->step.__stateful) return false;
+    const int32_t cell_length=starts[1];
+    int sentinel=-1;
+    uint32_t marker;
+    for (int byte=0; byte<256 && sentinel < 0; byte++){
+        const unsigned char candidate=byte;
+        size_t count;
+        if (
+            !memchr(src, byte, cell_length-1) &&
+            gconv_run(gconv, NULL, &candidate, 1, true, &marker, 1, &count, NULL) == __GCONV_EMPTY_INPUT &&
+            count == 1
+        )
+            sentinel=byte;
+    }
+    if (sentinel < 0) return false;
+    unsigned char batch[256*(cell_length+1)];
+    size_t batch_length=0;
+    for (int cell=0; cell<256; cell++){
+        if (cell == sentinel) continue;
+        memcpy(batch+batch_length, src+starts[cell], cell_length);
+        batch_length+=cell_length;
+        batch[batch_length++]=sentinel;
+    }
+    enum {capacity=256*8};
+    uint32_t ucs4[capacity];
+    size_t count;
+    if (gconv_error(gconv_run(gconv, NULL, batch, batch_length, true, ucs4, capacity, &count, NULL)) != U_ZERO_ERROR)
+        return false;
+    size_t start=0;
+    for (int cell=0; cell<256; cell++){
+        if (cell == sentinel) continue;
+        size_t end=start;
+        while (end < count && ucs4[end] != marker) end++;
+        if (end == count) return false;
+        size_t length_utf16=0;
+        cells[cell].err=gconv_cell(ucs4+start, end-start, cells[cell].str_utf16, &length_utf16);
+        cells[cell].length_utf16=length_utf16;
+        start=end+1;
+    }
+    if (start != count) return false;
+    convert_cell(config, src+starts[sentinel], cell_length, &cells[sentinel]);
+    return true;
+}
+#endif
+static void convert_table(const Config config, const inbuf_type * inbuf, int table, Cell cells[256]){
+    if (config.state) {
+        for (int i=0; i<256; i++){
+            const char bytes[2]={table, i};
+            memset(&cells[i], 0, sizeof(Cell));
+            if (config.wide) state_convert_cell(config, config.state, bytes, 2, &cells[i]);
+            else state_convert_cell(config, config.state, bytes+1, 1, &cells[i]);
+        }
+        return;
+    }
+    const size_t cell_length=inbuf->index+(config.wide?2:1);
+    char src[256*cell_length];
+    int32_t starts[257];
+    for (int i=0; i<256; i++){
+        char * cell_src=&src[i*cell_length];
+        starts[i]=i*cell_length;
+        memcpy(cell_src, inbuf->buf, inbuf->index);
+        if (config.wide) {
+            cell_src[inbuf->index]=table;
+            cell_src[inbuf->index+1]=i;
+        } else 
+            cell_src[inbuf->index]=i;
+        memset(&cells[i], 0, sizeof(Cell));
+    }
+    starts[256]=256*cell_length;
+
+    if (config.backend == ICU && icu_batchable(config.converter))
+        convert_table_icu(config, src, starts, cells);
+    #ifdef ENABLE_GCONV
+    else if (config.backend == GCONV && convert_table_gconv(config, src, starts, cells));
+    #endif
+    else for (int i=0; i<256; i++)
+        convert_cell(config, &src[starts[i]], cell_length, &cells[i]);
+}
+
+#ifndef CPDISP_LIBRARY
+#define format for(bool _once=1; _once && !config.no_format_bool; _once=0)
+/* Red in the chart */
+static bool cell_invalid(const Cell * cell){
+    const UErrorCode err=cell->err;
+    return err==U_INVALID_CHAR_FOUND ||
+        err==U_ILLEGAL_CHAR_FOUND ||
+        err==U_ILLEGAL_ESCAPE_SEQUENCE ||
+        err==U_UNSUPPORTED_ESCAPE_SEQUENCE || 
+        (cell->flags & CP_UNDEFINED);
+}
+#endif
+
+typedef enum {
+    CELL_VALID=CPDISP_VALID,
+    CELL_INVALID=CPDISP_INVALID,
+    CELL_TRUNCATED=CPDISP_TRUNCATED,
+    CELL_ERROR=CPDISP_ERROR
+} CellClass;
+
+static CellClass cell_class(const Cell * cell){
+    const UErrorCode err=cell->err;
+    if (U_SUCCESS(err)) return CELL_VALID;
+    if (err == U_TRUNCATED_CHAR_FOUND) return CELL_TRUNCATED;
+    if (err==U_INVALID_CHAR_FOUND ||
+        err==U_ILLEGAL_CHAR_FOUND ||
+        err==U_ILLEGAL_ESCAPE_SEQUENCE ||
+        err==U_UNSUPPORTED_ESCAPE_SEQUENCE)
+        return CELL_INVALID;
+    return CELL_ERROR;
+}
+
+#ifndef CPDISP_LIBRARY
+/* heat replaces the background of everything but errors when it isn't 0 */
+static void print_cell(const Config config, const Cell * cell, int heat, OutBuf * out){
+    UErrorCode err=cell->err;
+    UChar str_utf16[17]={0};
+    UChar* str_utf16_ptr=str_utf16+2;
+    size_t length_utf16=cell->length_utf16;
+    memcpy(str_utf16_ptr, cell->str_utf16, sizeof(cell->str_utf16));
+    // format printf("\e8\e[%dB\e[%dC",y+1,x*2+2);
+    if (cell_invalid(cell)) 
+        format attrPrintSpace(out, attribute_red_background);
+    else if (err==U_TRUNCATED_CHAR_FOUND)
+        format attrPrintSpace(out, attribute_green_background);
+    else if (U_FAILURE(err) ) 
+        format attrPrintMessage(out, attribute_yellow_background,u_errorName(err));
+    else {
+        UChar32 c;
+        if(!config.control_codes_raw && cell->control >= 0){
+            if (config.verbose_control_codes_and_whitespace) {
+                U16_GET(str_utf16_ptr, 0, cell->control, length_utf16, c);
+                format attrPrintCodepointAsHex(out, heat?heat:attribute_bright_blue_background, c);
+            } else 
+                format attrPrintSpace(out, heat?heat:attribute_blue_background);
+        }
+        else if(
+            !config.control_codes_raw && 
+            config.verbose_control_codes_and_whitespace && 
+            cell->whitespace >= 0 && 
+            (str_utf16_ptr[cell->whitespace] != ' ')
+        ) {
+            U16_GET(str_utf16_ptr, 0, cell->whitespace, length_utf16, c);
+            format attrPrintCodepointAsHex(out, heat?heat:attribute_light_gray_background, c);
+        }
+        else {
+            char out_buf_utf8[33];
+            const bool circle=!config.no_format_bool && (cell->first_flags & CP_COMBINING);
+            if (circle){
+                *--str_utf16_ptr=u'◌';
+                length_utf16++;
+            }
+            u_strToUTF8(
+                out_buf_utf8,
+                33, 
+                NULL,
+                str_utf16_ptr,
+                length_utf16, 
+                &idc
+            );
+            
+            if (!config.no_format_bool) {
+                /* The dotted circle is an Other Neutral, so it needs the override too */
+                (circle || (cell->flags & CP_NOT_LTR)?attrPrintIsolated:attrPrint)(
+                    out,
+                    heat?heat:(cell->flags & CP_PUA)?attribute_magenta_background:attribute_default_background,
+                    out_buf_utf8
+                );
+                if (!(circle?cell->wide_with_circle:cell->wide))
+                    out_char(out, ' ');
+                
+            }
+            else 
+                out_str(out, out_buf_utf8);
+                
+        }
+    }
+}
+
+/* The colour print_cell gives the cell, for --stats */
+static LegendCategory legend_category(const Config config, const Cell * cell){
+    if (cell_invalid(cell)) return LEGEND_INVALID;
+    if (cell->err == U_TRUNCATED_CHAR_FOUND) return LEGEND_TRUNCATED;
+    if (U_FAILURE(cell->err)) return LEGEND_ERROR;
+    if (config.control_codes_raw) return cell->flags & CP_PUA?LEGEND_PUA:LEGEND_PLAIN;
+    if (cell->control >= 0) return LEGEND_CONTROL;
+    if (
+        config.verbose_control_codes_and_whitespace &&
+        cell->whitespace >= 0 &&
+        cell->str_utf16[cell->whitespace] != ' '
+    )
+        return LEGEND_WHITESPACE;
+    return cell->flags & CP_PUA?LEGEND_PUA:LEGEND_PLAIN;
+}
+
+/*
+ * With -w, a table whose lead byte is a whole character or can't start
+ * anything at all is just that byte followed by every single byte (or 256
+ * red cells), so it's worked out once up front and never printed.
+ * ICU's MBCS tables know their lead bytes, every other lead byte is
+ * converted on its own: a truncated (or not yet flushed) sequence means
+ * there's something to see in the table. A byte that's a character on
+ * its own can still start longer ones (GSM's escape to its extension
+ * table, ISCII's nukta), so unless the converter never reads more than a
+ * byte at a time its table is converted and only left out if every cell
+ * is the lead byte's character followed by the trail byte's.
+ */
+typedef enum {
+    TABLE_LIVE,
+    TABLE_SINGLE_BYTE,
+    TABLE_INVALID
+} TableKind;
+
+/* Whether pair is what the lead and trail bytes convert to one after the other */
+static bool cell_is_pair(const Cell * lead, const Cell * trail, const Cell * pair){
+    if (U_FAILURE(trail->err)) return pair->err == trail->err;
+    return U_SUCCESS(pair->err) &&
+        pair->length_utf16 == lead->length_utf16+trail->length_utf16 &&
+        !memcmp(pair->str_utf16, lead->str_utf16, lead->length_utf16*sizeof(UChar)) &&
+        !memcmp(pair->str_utf16+lead->length_utf16, trail->str_utf16, trail->length_utf16*sizeof(UChar));
+}
+
+static void find_dead_tables(const Config config, const inbuf_type * inbuf, uint8_t table_kinds[256]){
+    UBool starters[256];
+    bool have_starters=false, single_byte=false;
+    if (config.backend == ICU && !config.state) {
+        const UConverterType type=ucnv_getType(config.converter);
+        if (inbuf->index == 0 && (type == UCNV_MBCS || type == UCNV_DBCS)) {
+            UErrorCode err=U_ZERO_ERROR;
+            ucnv_getStarters(config.converter, starters, &err);
+            have_starters=U_SUCCESS(err);
+        }
+        single_byte=ucnv_getMaxCharSize(config.converter) == 1;
+    }
+    Config narrow=config, wide=config;
+    narrow.wide=false;
+    wide.wide=true;
+    Cell singles[256], pairs[256], bare[256];
+    convert_table(narrow, inbuf, 0, singles);
+    /* Singles are the prefix and then the byte, what follows the lead is the byte on its own */
+    const Cell * trails=singles;
+    if (inbuf->index || config.state) {
+        const inbuf_type empty={0};
+        Config initial=narrow;
+        initial.state=NULL;
+        convert_table(initial, &empty, 0, bare);
+        trails=bare;
+    }
+    for (int table=0; table<256; table++){
+        const Cell * lead=&singles[table];
+        if (have_starters && starters[table])
+            table_kinds[table]=TABLE_LIVE;
+        else if (lead->err == U_ILLEGAL_CHAR_FOUND || lead->err == U_INVALID_CHAR_FOUND)
+            table_kinds[table]=TABLE_INVALID;
+        else if (U_FAILURE(lead->err) || lead->length_utf16 == 0)
+            table_kinds[table]=TABLE_LIVE;
+        else if (single_byte)
+            table_kinds[table]=TABLE_SINGLE_BYTE;
+        else {
+            convert_table(wide, inbuf, table, pairs);
+            table_kinds[table]=TABLE_SINGLE_BYTE;
+            for (int trail=0; trail<256; trail++)
+                if (!cell_is_pair(lead, &trails[trail], &pairs[trail])) {
+                    table_kinds[table]=TABLE_LIVE;
+                    break;
+                }
+        }
+    }
+}
+
+/* A run of dead tables of the same kind is printed as one line by its first table */
+static bool table_printed(const Config config, int table){
+    if (!config.table_kinds || config.table_kinds[table] == TABLE_LIVE) return true;
+    if (config.skip_dead || config.no_format_bool) return false;
+    return table == config.from_table || config.table_kinds[table-1] != config.table_kinds[table];
+}
+
+static void print_dead_tables(const Config config, int table, OutBuf * out){
+    if (!table_printed(config, table)) return;
+    const uint8_t kind=config.table_kinds[table];
+    int last=table;
+    while (last < config.to_table && config.table_kinds[last+1] == kind) last++;
+    out->attribute=0;
+    if (last == table) {
+        out_literal(out, "Table ");
+        out_uint(out, table);
+    } else {
+        out_literal(out, "Tables ");
+        out_uint(out, table);
+        out_char(out, '-');
+        out_uint(out, last);
+    }
+    if (kind == TABLE_INVALID) {
+        out_literal(out, ": ");
+        attrPrintSpace(out, attribute_red_background);
+        attrReset(out, " invalid lead byte\n\n");
+    } else
+        out_literal(out, ": single byte characters\n\n");
+}
+
+/*
+ * --format: instead of the chart, one record per cell with its bytes,
+ * code points, error class and classification flags (and with --names,
+ * the names of the code points). Records are appended to the table's
+ * OutBuf, which is flushed after every table like the chart is.
+ *
+ * The binary format is a fixed 96 byte little endian record:
+ *     0 u8 number of bytes (at most 16 are kept)
+ *     1 u8 CellClass
+ *     2 u8 CP_* flags of all code points ORed together
+ *     3 u8 number of code points
+ *     4 u32 ICU error code
+ *     8 u8[16] bytes
+ *     24 u32[15] code points
+ *     84 12 bytes of zeroes
+ */
+static const char * const cell_class_names[]={
+    [CELL_VALID]="valid",
+    [CELL_INVALID]="invalid",
+    [CELL_TRUNCATED]="truncated",
+    [CELL_ERROR]="error"
+};
+/* In bit order of the CP_* flags */
+static const char * const cp_flag_names[8]={
+    "undefined", "control", "whitespace", "pua",
+    "combining", "nonspacing", "wide", "not-ltr"
+};
+
+static void out_u32le(OutBuf * out, uint32_t value){
+    for (int i=0; i<4; i++) out_char(out, value>>(8*i));
+}
+
+/* JSON escapes the quotes, CSV doubles them */
+static void out_quoted(OutBuf * out, OutputFormat output_format, const char * str, size_t length){
+    out_char(out, '"');
+    for (const unsigned char * c=(const unsigned char *)str; c < (const unsigned char *)str+length; c++){
+        if (output_format == FORMAT_CSV) {
+            if (*c == '"') out_char(out, '"');
+            out_char(out, *c);
+        } else if (*c == '"' || *c == '\\') {
+            out_char(out, '\\');
+            out_char(out, *c);
+        } else if (*c < 0x20) {
+            out_literal(out, "\\u00");
+            out_char(out, hex_digits[*c>>4]);
+            out_char(out, hex_digits[*c&15]);
+        } else 
+            out_char(out, *c);
+    }
+    out_char(out, '"');
+}
+
+static void emit_header(const Config config){
+    if (config.output_format != FORMAT_CSV) return;
+    OutBuf out={0};
+    out_str(&out, config.names?
+        "bytes,class,error,codepoints,text,flags,names\n":
+        "bytes,class,error,codepoints,text,flags\n"
+    );
+    out_flush(&out, config.output_fd);
+    free(out.buf);
+}
+
+static void emit_record(const Config config, const unsigned char * bytes, size_t length, const Cell * cell, OutBuf * out){
+    const CellClass class=cell_class(cell);
+    UChar32 codepoints[15];
+    int count=0;
+    for (int32_t i=0; i<cell->length_utf16; count++)
+        U16_NEXT(cell->str_utf16, i, cell->length_utf16, codepoints[count]);
+
+    if (config.output_format == FORMAT_BINARY) {
+        const size_t kept=length<16?length:16;
+        out_char(out, kept);
+        out_char(out, class);
+        out_char(out, cell->flags);
+        out_char(out, count);
+        out_u32le(out, cell->err);
+        out_append(out, (const char *)bytes, kept);
+        for (size_t i=kept; i<16; i++) out_char(out, 0);
+        for (int i=0; i<15; i++) out_u32le(out, i<count?codepoints[i]:0);
+        for (int i=0; i<12; i++) out_char(out, 0);
+        return;
+    }
+    const bool json=config.output_format == FORMAT_JSONL;
+    const char separator=json?',':' ';
+    char text[64];
+    int32_t text_length=0;
+    UErrorCode err=U_ZERO_ERROR;
+    u_strToUTF8(text, sizeof(text), &text_length, cell->str_utf16, cell->length_utf16, &err);
+    if (U_FAILURE(err) || class != CELL_VALID) text_length=0;
+
+    out_str(out, json?"{\"bytes\":\"":"");
+    for (size_t i=0; i<length; i++){
+        out_char(out, hex_digits[bytes[i]>>4]);
+        out_char(out, hex_digits[bytes[i]&15]);
+    }
+    out_str(out, json?"\",\"class\":\"":",");
+    out_str(out, cell_class_names[class]);
+    out_str(out, json?"\",\"error\":\"":",");
+    out_str(out, u_errorName(cell->err));
+    out_str(out, json?"\",\"codepoints\":[":",");
+    for (int i=0; i<count; i++){
+        if (i) out_char(out, separator);
+        if (json) out_uint(out, codepoints[i]);
+        else out_codepoint(out, codepoints[i]);
+    }
+    out_str(out, json?"],\"text\":":",");
+    out_quoted(out, config.output_format, text, text_length);
+    out_str(out, json?",\"flags\":[":",");
+    bool first=true;
+    for (int bit=0; bit<8; bit++)
+        if (cell->flags & (1<<bit)) {
+            if (!first) out_char(out, separator);
+            first=false;
+            if (json) out_quoted(out, config.output_format, cp_flag_names[bit], strlen(cp_flag_names[bit]));
+            else out_str(out, cp_flag_names[bit]);
+        }
+    if (config.names) {
+        out_str(out, json?"],\"names\":[":",\"");
+        for (int i=0; i<count; i++){
+            size_t name_length;
+            const char * name=char_name(codepoints[i], &name_length);
+            if (json) {
+                if (i) out_char(out, ',');
+                out_quoted(out, config.output_format, name, name_length);
+            } else {
+                if (i) out_char(out, ';');
+                out_append(out, name, name_length);
+            }
+        }
+        out_str(out, json?"]}\n":"\"\n");
+    } else
+        out_str(out, json?"]}\n":"\n");
+}
+
+/* Records for prefix+table+byte (or prefix+byte) */
+static void emit_cells(const Config config, const inbuf_type * inbuf, int table, const Cell cells[256], OutBuf * out){
+    unsigned char bytes[inbuf->index+2];
+    memcpy(bytes, inbuf->buf, inbuf->index);
+    size_t length=inbuf->index;
+    if (config.wide) bytes[length++]=table;
+    length++;
+    for (int i=0; i<256; i++){
+        bytes[length-1]=i;
+        emit_record(config, bytes, length, &cells[i], out);
+    }
+}
+
+/*
+ * Cache of converted and classified tables, one file per codepage,
+ * backend, prefix, data file and library version. The file is mapped
+ * and holds a header followed by room for all 256 tables; a table is
+ * written once and then marked present, so concurrent runs and -j
+ * workers never see half a table.
+ */
+enum { CELL_CACHE_VERSION=1 };
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t cell_size;
+    char key[1024];
+    _Atomic uint8_t present[256];
+} CellCacheHeader;
+typedef struct CellCache {
+    CellCacheHeader * header;
+    Cell * tables;
+    size_t size;
+} CellCache;
+static const char cell_cache_magic[8]="cpdisp\0c";
+
+
+/* 0 if the file can't be read */
+static uint64_t hash_file(const char * filename){
+    int fd=open(filename, O_RDONLY);
+    if (fd < 0) return 0;
+    struct stat st;
+    uint64_t hash=0;
+    if (fstat(fd, &st) == 0 && st.st_size > 0){
+        void * data=mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data != MAP_FAILED){
+            hash=fnv1a(fnv1a_basis, data, st.st_size);
+            munmap(data, st.st_size);
+        }
+    }
+    close(fd);
+    return hash;
+}
+
+static bool cell_cache_key(const Config config, const inbuf_type * inbuf, char * key, size_t size){
+    UVersionInfo icu_version;
+    char icu_version_string[U_MAX_VERSION_STRING_LENGTH];
+    u_getVersion(icu_version);
+    u_versionToString(icu_version, icu_version_string);
+    uint64_t data_hash=0;
+    if (config.data_file) {
+        data_hash=hash_file(config.data_file);
+        if (!data_hash) {
+            char dat_filename[strlen(config.data_file)+5];
+            sprintf(dat_filename, "%s.dat", config.data_file);
+            data_hash=hash_file(dat_filename);
+        }
+    }
+    if (config.backend == MAPPING_FILE) data_hash=hash_file(config.codepage);
+    const char * libc_version="";
+    #ifdef __GLIBC__
+    libc_version=gnu_get_libc_version();
+    #endif
+    int libiconv_version=0;
+    #ifdef ENABLE_LIBICONV
+    libiconv_version=_libiconv_version;
+    #endif
+    char prefix[2*inbuf->index+1];
+    for (size_t i=0; i<inbuf->index; i++)
+        sprintf(prefix+2*i, "%02hhx", inbuf->buf[i]);
+    prefix[2*inbuf->index]=0;
+    int length=snprintf(key, size,
+        "backend=%d\ncodepage=%s\nprefix=%s\nwide=%d\ndata=%s:%016llx\nicu=%s\nlibc=%s\nlibiconv=%x\n",
+        config.backend,
+        config.codepage,
+        prefix,
+        config.wide,
+        config.data_file?config.data_file:"",
+        (unsigned long long)data_hash,
+        icu_version_string,
+        libc_version,
+        libiconv_version
+    );
+    return length > 0 && (size_t)length < size;
+}
+
+/* An empty cache renamed over filename once it's the right size, returns the fd or -1 */
+static int create_cell_cache(const char * filename, size_t size, const CellCacheHeader * header){
+    char temporary[strlen(filename)+8];
+    sprintf(temporary, "%s.XXXXXX", filename);
+    const int fd=mkstemp(temporary);
+    if (fd < 0) return -1;
+    if (
+        ftruncate(fd, size) != 0 ||
+        pwrite(fd, header, sizeof(*header), 0) != sizeof(*header) ||
+        fchmod(fd, 0644) != 0 ||
+        rename(temporary, filename) != 0
+    ) {
+        unlink(temporary);
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static CellCache * open_cell_cache(const Config config, const inbuf_type * inbuf){
+    #ifdef ENABLE_GCONV
+    if (config.backend == GCONV) return NULL;
+    #endif
+    CellCacheHeader header={.version=CELL_CACHE_VERSION, .cell_size=sizeof(Cell)};
+    memcpy(header.magic, cell_cache_magic, sizeof(header.magic));
+    if (!cell_cache_key(config, inbuf, header.key, sizeof(header.key))) return NULL;
+
+    const char * dir=config.cache_dir;
+    char default_dir[4096];
+    if (!*dir) {
+        const char * xdg=getenv("XDG_CACHE_HOME");
+        const char * home=getenv("HOME");
+        if (xdg && *xdg) snprintf(default_dir, sizeof(default_dir), "%s/cpdisp", xdg);
+        else if (home) snprintf(default_dir, sizeof(default_dir), "%s/.cache/cpdisp", home);
+        else return NULL;
+        /* Create ~/.cache too if it's missing */
+        char * slash=strrchr(default_dir, '/');
+        *slash=0;
+        mkdir(default_dir, 0755);
+        *slash='/';
+        dir=default_dir;
+    }
+    mkdir(dir, 0755);
+    char filename[strlen(dir)+32];
+    sprintf(filename, "%s/%016llx.cells", dir,
+        (unsigned long long)fnv1a(fnv1a_basis, header.key, strlen(header.key)));
+
+    const size_t size=sizeof(CellCacheHeader)+256*256*sizeof(Cell);
+    CellCacheHeader * map=MAP_FAILED;
+    int fd=open(filename, O_RDWR);
+    struct stat st;
+    if (fd >= 0 && fstat(fd, &st) == 0 && st.st_size == (off_t)size)
+        map=mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+    if (fd >= 0) close(fd);
+    if (map != MAP_FAILED && (
+        memcmp(map->magic, header.magic, sizeof(header.magic)) ||
+        map->version != header.version ||
+        map->cell_size != header.cell_size ||
+        strncmp(map->key, header.key, sizeof(header.key))
+    )) {
+        munmap(map, size);
+        map=MAP_FAILED;
+    }
+    if (map == MAP_FAILED) {
+        /*
+         * Missing, the wrong size or a hash collision with another key:
+         * start over in a new file, other runs may have the old one mapped
+         */
+        fd=create_cell_cache(filename, size, &header);
+        if (fd < 0) {
+            fprintf(stderr, "Can't open cache %s\n", filename);
+            return NULL;
+        }
+        map=mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+        close(fd);
+        if (map == MAP_FAILED) return NULL;
+    }
+    CellCache * cache=malloc(sizeof(CellCache));
+    *cache=(CellCache){
+        .header=map,
+        .tables=(Cell *)(map+1),
+        .size=size
+    };
+    return cache;
+}
+static void close_cell_cache(CellCache * cache){
+    if (!cache) return;
+    munmap(cache->header, cache->size);
+    free(cache);
+}
+/*
+ * Copies the table out of the file, which anything can write to, and
+ * false if it isn't there or a cell is out of bounds
+ */
+static bool cell_cache_get(CellCache * cache, int table, Cell cells[256]){
+    if (!cache || !atomic_load_explicit(&cache->header->present[table], memory_order_acquire))
+        return false;
+    memcpy(cells, &cache->tables[table*256], 256*sizeof(Cell));
+    for (int i=0; i<256; i++){
+        const Cell * cell=&cells[i];
+        if (
+            cell->length_utf16 > sizeof(cell->str_utf16)/sizeof(UChar) ||
+            cell->control < -1 || cell->control >= cell->length_utf16 ||
+            cell->whitespace < -1 || cell->whitespace >= cell->length_utf16
+        ) return false;
+    }
+    return true;
+}
+static void cell_cache_put(CellCache * cache, int table, const Cell cells[256]){
+    if (!cache) return;
+    memcpy(&cache->tables[table*256], cells, 256*sizeof(Cell));
+    atomic_store_explicit(&cache->header->present[table], 1, memory_order_release);
+}
+
+static const char row_labels[16][12]={
+    "\e[7m0\e[27m ", "\e[7m1\e[27m ", "\e[7m2\e[27m ", "\e[7m3\e[27m ",
+    "\e[7m4\e[27m ", "\e[7m5\e[27m ", "\e[7m6\e[27m ", "\e[7m7\e[27m ",
+    "\e[7m8\e[27m ", "\e[7m9\e[27m ", "\e[7ma\e[27m ", "\e[7mb\e[27m ",
+    "\e[7mc\e[27m ", "\e[7md\e[27m ", "\e[7me\e[27m ", "\e[7mf\e[27m "
+};
+
+/* The 16x16 grid under a table's title, and the legend for it */
+static void print_cells(const Config config, const Cell cells[256], const int * heat, OutBuf * out){
+    format out_literal(out, "  \e[7m0 1 2 3 4 5 6 7 8 9 a b c d e f \e[27m\n\n");
+    for (int i=0; i<16; i++){
+        format out_append(out, row_labels[i], sizeof(row_labels[i])-1);
+        for (int j=0; j<16; j++){
+            int x,y;
+            if (config.no_format_bool) {
+                x=j;
+                y=i;
+            } else {
+                x=config.column_order?i:j;
+                y=config.column_order?j:i;
+            }
+            print_cell(config, &cells[y*16+x], heat?heat[y*16+x]:0, out);
+        }
+        format attrReset(out, "\n");
+    }
+
+    format attrReset(out, "\n\n");
+    format printAllMessages(out);
+}
+
+static void print_table(const Config config, const inbuf_type * inbuf, int table, OutBuf * out){
+    current_stats=config.stats?&stats_tables[table]:NULL;
+    if (current_stats) current_stats->used=true;
+    uint64_t start=stats_begin();
+    if (config.table_kinds && config.table_kinds[table] != TABLE_LIVE) {
+        print_dead_tables(config, table, out);
+        stats_end(PHASE_FORMAT, start);
+        return;
+    }
+    Cell cells[256];
+    if (!cell_cache_get(config.cache, table, cells)){
+        convert_table(config, inbuf, table, cells);
+        stats_end(PHASE_CONVERT, start);
+        start=stats_begin();
+        for (int i=0; i<256; i++) classify_cell(&cells[i]);
+        stats_end(PHASE_CLASSIFY, start);
+        cell_cache_put(config.cache, table, cells);
+    }
+    if (current_stats) for (int i=0; i<256; i++)
+        current_stats->cells[legend_category(config, &cells[i])]++;
+    start=stats_begin();
+    if (config.output_format != FORMAT_ANSI)
+        emit_cells(config, inbuf, table, cells, out);
+    else {
+        out->attribute=0;
+        format {
+            out_literal(out, "Table ");
+            out_uint(out, table);
+            out_literal(out, ":\n");
+        }
+        print_cells(config, cells, NULL, out);
+    }
+    /* Names are looked up while formatting, they're taken out of it in the report */
+    stats_end(PHASE_FORMAT, start);
+}
+
+static void flush_table(const Config config, int table, OutBuf * out){
+    current_stats=config.stats?&stats_tables[table]:NULL;
+    const uint64_t start=stats_begin();
+    out_flush(out, config.output_fd);
+    stats_end(PHASE_WRITE, start);
+}
+
+/* Returns false if the user asked to stop */
+static bool interactive_prompt(const Config config, int table){
+    if(config.interactive && table != config.to_table && table_printed(config, table)) {
+        OutBuf prompt={0};
+        format out_literal(&prompt, "\n[q]: ");
+        out_flush(&prompt, config.output_fd);
+        char c;
+        while (((c=getchar()) != '\n') && (c !='q'));
+        if (c=='q') {
+            free(prompt.buf);
+            return false;
+        }
+        format out_literal(&prompt, "\n");
+        out_flush(&prompt, config.output_fd);
+        free(prompt.buf);
+    }
+    return true;
+}
+
+static void print_fonttest_serial(const Config config, const inbuf_type * inbuf){
+    OutBuf out={0};
+    for (int table=config.from_table; table <= config.to_table; table++){
+        print_table(config, inbuf, table, &out);
+        flush_table(config, table, &out);
+        if (!interactive_prompt(config, table)) break;
+    }
+    free(out.buf);
+}
+
+/*
+ * Each worker owns a converter and claims tables in order, rendering them
+ * into an OutBuf. The main thread writes finished tables out in table
+ * order so the output is the same as with one thread. Workers stay at
+ * most window tables ahead of the writer, and written buffers go back on
+ * the spare list for the next table.
+ */
+typedef struct {
+    OutBuf text;
+    bool ready;
+} RenderedTable;
+typedef struct {
+    mtx_t lock;
+    cnd_t ready, room;
+    int next_table, written, window;
+    bool stop;
+    const inbuf_type * inbuf;
+    RenderedTable tables[256];
+    int spare_count;
+    OutBuf spare[256];
+} RenderQueue;
+typedef struct {
+    Config config;
+    RenderQueue * queue;
+} Worker;
+
+static int render_worker(void * arg){
+    Worker * worker=arg;
+    RenderQueue * queue=worker->queue;
+    for (;;) {
+        mtx_lock(&queue->lock);
+        while (!queue->stop && queue->next_table - queue->written >= queue->window)
+            cnd_wait(&queue->room, &queue->lock);
+        if (queue->stop || queue->next_table > worker->config.to_table){
+            mtx_unlock(&queue->lock);
+            return 0;
+        }
+        const int table=queue->next_table++;
+        OutBuf out={0};
+        if (queue->spare_count) out=queue->spare[--queue->spare_count];
+        mtx_unlock(&queue->lock);
+
+        print_table(worker->config, queue->inbuf, table, &out);
+
+        mtx_lock(&queue->lock);
+        queue->tables[table]=(RenderedTable){.text=out, .ready=true};
+        cnd_broadcast(&queue->ready);
+        mtx_unlock(&queue->lock);
+    }
+}
+#endif
+
+static void * clone_converter(const Config config){
+    switch (config.backend){
+        case ICU:
+            return icu_clone(config.converter);
+        #ifdef ENABLE_ICONV
+        case ICONV: {
+            iconv_t cd=iconv_open(utf16_host_endian(), config.codepage);
+            return cd==(iconv_t)-1?NULL:cd;
+        }
+        #endif
+        #ifdef ENABLE_LIBICONV
+        case LIBICONV: {
+            void * cd=libiconv_open(utf16_host_endian(), config.codepage);
+            return cd==(void *)-1?NULL:cd;
+        }
+        #endif
+        case LOCALE:
+        case MAPPING_FILE:
+        #ifdef ENABLE_GCONV
+        /* The step isn't written to once it's set up */
+        case GCONV:
+        #endif
+            return config.converter;
+        default:
+            return NULL;
+    }
+}
+
+static void close_converter(const Config config){
+    switch (config.backend){
+        case LOCALE: {
+            LocaleConverter * converter=config.converter;
+            if (!converter) break;
+            free_locale_node(converter->root);
+            freelocale(converter->locale);
+            free(converter);
+        } break;
+        case MAPPING_FILE: {
+            MapConverter * map=config.converter;
+            if (map && map->base) munmap(map->base, map->size);
+            free(map);
+        } break;
+        #ifdef ENABLE_ICONV
+        case ICONV: 
+            iconv_close(config.converter);
+        break;
+        #endif
+        #ifdef ENABLE_LIBICONV
+        case LIBICONV: 
+            libiconv_close(config.converter);
+        break;
+        #endif
+        case ICU:
+            ucnv_close(config.converter);
+        break;
+        #ifdef ENABLE_GCONV
+        case GCONV:{
+            gconv_nonsense * gconv = config.converter;
+            if (gconv->gconv_end) gconv->gconv_end(&gconv->step);
+            dlclose(gconv->shared_object);
+            free(gconv);
+
+        } break;
+        #endif
+        default:
+        break;
+    }
+}
+
+#ifndef CPDISP_LIBRARY
+static void print_fonttest_parallel(const Config config, const inbuf_type * inbuf){
+    RenderQueue * queue=calloc(1, sizeof(RenderQueue));
+    Worker workers[config.jobs];
+    thrd_t threads[config.jobs];
+    int started=0;
+    mtx_init(&queue->lock, mtx_plain);
+    cnd_init(&queue->ready);
+    cnd_init(&queue->room);
+    queue->next_table=queue->written=config.from_table;
+    queue->window=2*config.jobs;
+    queue->inbuf=inbuf;
+    for (; started<config.jobs; started++){
+        workers[started]=(Worker){.config=config, .queue=queue};
+        workers[started].config.converter=clone_converter(config);
+        if (!workers[started].config.converter) break;
+        if (thrd_create(&threads[started], render_worker, &workers[started]) != thrd_success){
+            if (workers[started].config.converter != config.converter)
+                close_converter(workers[started].config);
+            break;
+        }
+    }
+    if (started == 0) {
+        print_fonttest_serial(config, inbuf);
+    } else for (int table=config.from_table; table <= config.to_table; table++){
+        mtx_lock(&queue->lock);
+        while (!queue->tables[table].ready)
+            cnd_wait(&queue->ready, &queue->lock);
+        mtx_unlock(&queue->lock);
+        OutBuf text=queue->tables[table].text;
+        flush_table(config, table, &text);
+        const bool go_on=interactive_prompt(config, table);
+        mtx_lock(&queue->lock);
+        queue->spare[queue->spare_count++]=text;
+        queue->tables[table].ready=false;
+        queue->written=table+1;
+        queue->stop=!go_on;
+        cnd_broadcast(&queue->room);
+        mtx_unlock(&queue->lock);
+        if (!go_on) break;
+    }
+    for (int i=0; i<started; i++){
+        thrd_join(threads[i], NULL);
+        if (workers[i].config.converter != config.converter)
+            close_converter(workers[i].config);
+    }
+    for (int table=config.from_table; table <= config.to_table; table++)
+        if (queue->tables[table].ready)
+            free(queue->tables[table].text.buf);
+    for (int i=0; i<queue->spare_count; i++)
+        free(queue->spare[i].buf);
+    cnd_destroy(&queue->room);
+    cnd_destroy(&queue->ready);
+    mtx_destroy(&queue->lock);
+    free(queue);
+}
+
+static void print_tables(Config config, const inbuf_type * inbuf){
+    uint8_t table_kinds[256];
+    if (
+        config.wide && !config.show_dead &&
+        (config.skip_dead || (!config.no_format_bool && config.output_format == FORMAT_ANSI))
+    ) {
+        find_dead_tables(config, inbuf, table_kinds);
+        config.table_kinds=table_kinds;
+    }
+    if (config.jobs > 1 && config.to_table > config.from_table)
+        print_fonttest_parallel(config, inbuf);
+    else
+        print_fonttest_serial(config, inbuf);
+}
+
+void print_fonttest(Config config, const inbuf_type * inbuf){
+    emit_header(config);
+    print_tables(config, inbuf);
+}
+
+/*
+ * -i on a terminal: a pager over the tables. A view is a prefix and
+ * either the one table of prefix+byte or, with -w or once zoomed into a
+ * cell, any table of prefix+table+byte. Tables are converted the first
+ * time they're shown and kept in a small LRU cache, and the pager keeps
+ * what it drew in every cell and line so a redraw only sends what
+ * changed, which is a couple of cells when the cursor moves.
+ */
+enum { pager_cache_size=64, pager_max_prefix=16, pager_grid_row=5, pager_info_row=22 };
+typedef struct {
+    unsigned char prefix[pager_max_prefix];
+    uint8_t prefix_length;
+    uint8_t table;
+    bool wide;
+} PagerView;
+typedef struct {
+    PagerView view;
+    uint64_t used;
+    Cell cells[256];
+} PagerTable;
+typedef struct {
+    Config config;
+    PagerTable tables[pager_cache_size];
+    int table_count;
+    uint64_t clock;
+    PagerView views[pager_max_prefix];
+    int depth;
+    int cursor;
+    int jump;
+    bool drawn;
+    OutBuf screen[256];
+    OutBuf title, info, legend;
+} Pager;
+
+static bool same_view(const PagerView * a, const PagerView * b){
+    return a->prefix_length == b->prefix_length && a->wide == b->wide &&
+        (!a->wide || a->table == b->table) &&
+        !memcmp(a->prefix, b->prefix, a->prefix_length);
+}
+
+static const Cell * pager_cells(Pager * pager, const PagerView * view){
+    PagerTable * slot=NULL;
+    for (int i=0; i<pager->table_count; i++)
+        if (same_view(&pager->tables[i].view, view)) {
+            pager->tables[i].used=++pager->clock;
+            return pager->tables[i].cells;
+        }
+    if (pager->table_count < pager_cache_size) slot=&pager->tables[pager->table_count++];
+    else {
+        slot=&pager->tables[0];
+        for (int i=1; i<pager_cache_size; i++)
+            if (pager->tables[i].used < slot->used) slot=&pager->tables[i];
+    }
+    union {
+        inbuf_type inbuf;
+        char storage[sizeof(inbuf_type)+pager_max_prefix];
+    } prefix;
+    prefix.inbuf.capacity=prefix.inbuf.index=view->prefix_length;
+    memcpy(prefix.inbuf.buf, view->prefix, view->prefix_length);
+    Config config=pager->config;
+    config.wide=view->wide;
+    convert_table(config, &prefix.inbuf, view->table, slot->cells);
+    for (int i=0; i<256; i++) classify_cell(&slot->cells[i]);
+    slot->view=*view;
+    slot->used=++pager->clock;
+    return slot->cells;
+}
+
+/* Replaces *old with line and moves the cursor there to draw it if they differ */
+static void pager_line(Pager * pager, OutBuf * old, OutBuf * line, int row, bool to_end, OutBuf * out){
+    if (pager->drawn && old->length == line->length && !memcmp(old->buf, line->buf, line->length)) return;
+    out_literal(out, "\e[");
+    out_uint(out, row);
+    out_literal(out, ";1H");
+    out_append(out, line->buf, line->length);
+    out_str(out, to_end?"\e[0m\e[J":"\e[0m\e[K");
+    const OutBuf swap=*old;
+    *old=*line;
+    *line=swap;
+}
+
+static void pager_draw(Pager * pager){
+    const Config config=pager->config;
+    const PagerView * view=&pager->views[pager->depth];
+    const Cell * cells=pager_cells(pager, view);
+    OutBuf out={0}, line={0};
+    if (!pager->drawn) {
+        out_literal(&out, "\e[H\e[2J\e[3;1H  \e[7m0 1 2 3 4 5 6 7 8 9 a b c d e f \e[27m");
+        for (int row=0; row<16; row++){
+            out_literal(&out, "\e[");
+            out_uint(&out, pager_grid_row+row);
+            out_literal(&out, ";1H");
+            out_append(&out, row_labels[row], sizeof(row_labels[row])-1);
+        }
+    }
+
+    if (view->wide) {
+        out_literal(&line, "Table ");
+        out_uint(&line, view->table);
+    } else out_literal(&line, "Table");
+    if (view->prefix_length) out_literal(&line, " after");
+    for (int i=0; i<view->prefix_length; i++){
+        out_char(&line, ' ');
+        out_char(&line, hex_digits[view->prefix[i]>>4]);
+        out_char(&line, hex_digits[view->prefix[i]&15]);
+    }
+    out_literal(&line, "   \e[2m[n]ext [p]rev [00-ff] jump [enter] zoom [u]p [q]uit");
+    if (pager->jump >= 0) {
+        out_literal(&line, "  jump to ");
+        out_char(&line, hex_digits[pager->jump]);
+    }
+    pager_line(pager, &pager->title, &line, 1, false, &out);
+
+    /* Every cell is drawn again so legend ids come out the same, but only changed ones are sent */
+    for (int i=0; i<256; i++){
+        line.length=0;
+        line.attribute=0;
+        if (i == pager->cursor) out_literal(&line, "\e[7m");
+        print_cell(config, &cells[i], 0, &line);
+        out_literal(&line, "\e[0m");
+        OutBuf * old=&pager->screen[i];
+        if (pager->drawn && old->length == line.length && !memcmp(old->buf, line.buf, line.length)) continue;
+        const int row=config.column_order?i&15:i>>4, column=config.column_order?i>>4:i&15;
+        out_literal(&out, "\e[");
+        out_uint(&out, pager_grid_row+row);
+        out_char(&out, ';');
+        out_uint(&out, 3+2*column);
+        out_char(&out, 'H');
+        out_append(&out, line.buf, line.length);
+        const OutBuf swap=*old;
+        *old=line;
+        line=swap;
+    }
+
+    /* The bytes under the cursor and what they are */
+    line.length=0;
+    const Cell * cell=&cells[pager->cursor];
+    for (int i=0; i<view->prefix_length; i++){
+        out_char(&line, hex_digits[view->prefix[i]>>4]);
+        out_char(&line, hex_digits[view->prefix[i]&15]);
+        out_char(&line, ' ');
+    }
+    if (view->wide) {
+        out_char(&line, hex_digits[view->table>>4]);
+        out_char(&line, hex_digits[view->table&15]);
+        out_char(&line, ' ');
+    }
+    out_char(&line, hex_digits[pager->cursor>>4]);
+    out_char(&line, hex_digits[pager->cursor&15]);
+    out_literal(&line, ":");
+    if (U_FAILURE(cell->err)) {
+        out_char(&line, ' ');
+        out_str(&line, u_errorName(cell->err));
+    } else for (int32_t i=0; i<cell->length_utf16;){
+        UChar32 c;
+        U16_NEXT(cell->str_utf16, i, cell->length_utf16, c);
+        size_t name_length;
+        const char * name=char_name(c, &name_length);
+        out_char(&line, ' ');
+        out_codepoint(&line, c);
+        out_char(&line, ' ');
+        out_append(&line, name, name_length);
+    }
+    pager_line(pager, &pager->info, &line, pager_info_row, false, &out);
+
+    line.length=0;
+    printAllMessages(&line);
+    pager_line(pager, &pager->legend, &line, pager_info_row+2, true, &out);
+
+    pager->drawn=true;
+    out_flush(&out, config.output_fd);
+    free(out.buf);
+    free(line.buf);
+}
+
+/* Moves the cursor by rows and columns on the screen, which are swapped with -z */
+static void pager_move(Pager * pager, int down, int right){
+    int row=pager->config.column_order?pager->cursor&15:pager->cursor>>4;
+    int column=pager->config.column_order?pager->cursor>>4:pager->cursor&15;
+    row=(row+down)&15;
+    column=(column+right)&15;
+    pager->cursor=pager->config.column_order?column<<4|row:row<<4|column;
+}
+
+static void pager_page(Pager * pager, int step){
+    PagerView * view=&pager->views[pager->depth];
+    if (!view->wide) return;
+    const int first=pager->depth?0:pager->config.from_table;
+    const int last=pager->depth?255:pager->config.to_table;
+    const int table=view->table+step;
+    if (table >= first && table <= last) view->table=table;
+}
+
+static void pager_zoom(Pager * pager){
+    const PagerView * view=&pager->views[pager->depth];
+    const int length=view->prefix_length+(view->wide?1:0);
+    if (pager->depth+1 >= pager_max_prefix || length > pager_max_prefix) return;
+    PagerView * zoomed=&pager->views[++pager->depth];
+    *zoomed=*view;
+    if (view->wide) zoomed->prefix[zoomed->prefix_length++]=view->table;
+    zoomed->table=pager->cursor;
+    zoomed->wide=true;
+}
+
+static bool pager_usable(const Config config){
+    return config.interactive && config.output_format == FORMAT_ANSI && !config.no_format_bool &&
+        isatty(STDIN_FILENO) && isatty(config.output_fd);
+}
+
+static void browse(Config config, const inbuf_type * inbuf){
+    struct termios saved;
+    if (inbuf->index > pager_max_prefix-2 || tcgetattr(STDIN_FILENO, &saved)) {
+        print_fonttest(config, inbuf);
+        return;
+    }
+    struct termios raw=saved;
+    raw.c_lflag&=~(ICANON | ECHO | ISIG | IEXTEN);
+    raw.c_iflag&=~(IXON | ICRNL);
+    raw.c_cc[VMIN]=1;
+    raw.c_cc[VTIME]=0;
+    tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw);
+    OutBuf out={0};
+    out_literal(&out, "\e[?1049h\e[?25l");
+    out_flush(&out, config.output_fd);
+
+    Pager * pager=calloc(1, sizeof(Pager));
+    /* Views have their own prefixes, which don't match the cache's key */
+    config.cache=NULL;
+    pager->config=config;
+    pager->jump=-1;
+    pager->views[0].prefix_length=inbuf->index;
+    memcpy(pager->views[0].prefix, inbuf->buf, inbuf->index);
+    pager->views[0].wide=config.wide;
+    pager->views[0].table=config.from_table;
+    for (bool quit=false; !quit;){
+        pager_draw(pager);
+        unsigned char key[8];
+        const ssize_t length=read(STDIN_FILENO, key, sizeof(key));
+        if (length <= 0) break;
+        const int hex=isxdigit(key[0])?(isdigit(key[0])?key[0]-'0':tolower(key[0])-'a'+10):-1;
+        if (length == 1 && hex >= 0) {
+            if (pager->jump < 0) pager->jump=hex;
+            else {
+                const int table=pager->jump<<4|hex;
+                pager->jump=-1;
+                pager_page(pager, table-pager->views[pager->depth].table);
+            }
+            continue;
+        }
+        pager->jump=-1;
+        if (length >= 3 && key[0] == '\e' && key[1] == '[') switch (key[2]){
+            case 'A': pager_move(pager, -1, 0); break;
+            case 'B': pager_move(pager, 1, 0); break;
+            case 'C': pager_move(pager, 0, 1); break;
+            case 'D': pager_move(pager, 0, -1); break;
+            case '5': pager_page(pager, -1); break;
+            case '6': pager_page(pager, 1); break;
+        } else switch (key[0]){
+            case 'q':
+            case 3:
+                quit=true;
+            break;
+            case 'k': pager_move(pager, -1, 0); break;
+            case 'j': pager_move(pager, 1, 0); break;
+            case 'l': pager_move(pager, 0, 1); break;
+            case 'h': pager_move(pager, 0, -1); break;
+            case 'n':
+            case ' ':
+                pager_page(pager, 1);
+            break;
+            case 'p':
+                pager_page(pager, -1);
+            break;
+            case '\r':
+            case '\n':
+            case 'z':
+                pager_zoom(pager);
+            break;
+            case 'u':
+            case '\e':
+            case 127:
+            case '\b':
+                if (pager->depth) pager->depth--;
+            break;
+            /* ^L draws everything again */
+            case 12:
+                pager->drawn=false;
+            break;
+        }
+    }
+
+    out_literal(&out, "\e[0m\e[?25h\e[?1049l");
+    out_flush(&out, config.output_fd);
+    tcsetattr(STDIN_FILENO, TCSAFLUSH, &saved);
+    for (int i=0; i<256; i++) free(pager->screen[i].buf);
+    free(pager->title.buf);
+    free(pager->info.buf);
+    free(pager->legend.buf);
+    free(pager);
+    free(out.buf);
+}
+
+/*
+ * --explore: starting from the -x prefix, print the table of every prefix
+ * that is an incomplete character, depth first in byte order. Instead of
+ * recursing, each level keeps a bitmap of the incomplete cells it still
+ * has to visit, so memory is bounded by the depth and each table is
+ * written out as soon as it's converted. Tables where nothing is valid
+ * are pruned along with everything under them.
+ */
+typedef struct {
+    uint64_t pending[4];
+} ExploreLevel;
+
+/* Converts prefix+byte for every byte; false if every cell is invalid */
+static bool explore_convert(const Config config, const inbuf_type * prefix, Cell cells[256], ExploreLevel * level){
+    bool any_valid=false;
+    convert_table(config, prefix, 0, cells);
+    *level=(ExploreLevel){0};
+    for (int i=0; i<256; i++){
+        classify_cell(&cells[i]);
+        if (!cell_invalid(&cells[i])) any_valid=true;
+        if (cells[i].err == U_TRUNCATED_CHAR_FOUND)
+            level->pending[i>>6]|=UINT64_C(1)<<(i&63);
+    }
+    return any_valid;
+}
+
+static int explore_next(ExploreLevel * level){
+    for (int word=0; word<4; word++)
+        if (level->pending[word]) {
+            const int bit=__builtin_ctzll(level->pending[word]);
+            level->pending[word]&=level->pending[word]-1;
+            return word*64+bit;
+        }
+    return -1;
+}
+
+static void out_prefix(OutBuf * out, const inbuf_type * prefix){
+    out_literal(out, "Prefix");
+    for (size_t i=0; i<prefix->index; i++){
+        const unsigned char byte=prefix->buf[i];
+        out_char(out, ' ');
+        out_char(out, hex_digits[byte>>4]);
+        out_char(out, hex_digits[byte&15]);
+    }
+    out_literal(out, ":\n");
+}
+
+static void print_explore_table(const Config config, const inbuf_type * prefix, const Cell cells[256], OutBuf * out){
+    if (config.output_format != FORMAT_ANSI) {
+        emit_cells(config, prefix, 0, cells, out);
+        out_flush(out, config.output_fd);
+        return;
+    }
+    out->attribute=0;
+    format out_prefix(out, prefix);
+    print_cells(config, cells, NULL, out);
+    out_flush(out, config.output_fd);
+}
+
+static void explore(Config config, const inbuf_type * inbuf){
+    const int depth=config.explore_depth;
+    inbuf_type * prefix=malloc(sizeof(inbuf_type)+inbuf->index+depth);
+    prefix->capacity=inbuf->index+depth;
+    prefix->index=inbuf->index;
+    memcpy(prefix->buf, inbuf->buf, inbuf->index);
+    /* Every table is prefix+byte, and prefixes don't match the cache's key */
+    config.wide=false;
+    config.cache=NULL;
+    ExploreLevel levels[depth];
+    emit_header(config);
+    Cell cells[256];
+    OutBuf out={0};
+
+    explore_convert(config, prefix, cells, &levels[0]);
+    print_explore_table(config, prefix, cells, &out);
+    int level=0;
+    while (level >= 0){
+        const int byte=explore_next(&levels[level]);
+        if (byte < 0) {
+            if (level-- > 0) prefix->index--;
+            continue;
+        }
+        prefix->buf[prefix->index++]=byte;
+        ExploreLevel next;
+        if (!explore_convert(config, prefix, cells, &next)) {
+            prefix->index--;
+            continue;
+        }
+        print_explore_table(config, prefix, cells, &out);
+        if (level+1 < depth) levels[++level]=next;
+        else prefix->index--;
+    }
+    free(out.buf);
+    free(prefix);
+}
+
+/*
+ * --stateful: the tables of every shift state reachable from the prefix.
+ * Starting from the state after the prefix, a sequence of up to
+ * stateful_depth bytes that converts to nothing is an escape, and the
+ * state it leaves the converter in is a new one if its cells don't hash
+ * the same as those of a state already found. Incomplete sequences are
+ * followed past a byte unless that byte with something else after it
+ * makes a character, which means it's a lead byte, and past two bytes
+ * only while few of them are incomplete, since glibc calls anything
+ * after an ESC incomplete until it has three bytes to look at (and then
+ * passes unknown escapes through as characters).
+ */
+enum { max_shift_states=32, shift_fanout=8 };
+typedef struct {
+    ConverterState state;
+    inbuf_type * path;
+    uint64_t fingerprint;
+} ShiftState;
+typedef struct {
+    Config config;
+    int count;
+    ShiftState states[max_shift_states];
+    char sequence[16];
+} ShiftSearch;
+
+static uint64_t hash_cell(uint64_t hash, const Cell * cell){
+    hash=fnv1a(hash, &cell->err, sizeof(cell->err));
+    hash=fnv1a(hash, &cell->length_utf16, sizeof(cell->length_utf16));
+    return fnv1a(hash, cell->str_utf16, cell->length_utf16*sizeof(UChar));
+}
+
+/* Every byte, and a few trail bytes after those that don't make anything. Dead if nothing makes a character */
+static uint64_t state_fingerprint(const Config config, const ConverterState * state, bool * dead){
+    static const unsigned char trail_bytes[]={0x21, 0x30, 0x41, 0x5a, 0x61, 0x7e, 0xa1, 0xb0, 0xc1, 0xfe};
+    uint64_t hash=fnv1a_basis;
+    *dead=true;
+    for (int byte=0; byte<256; byte++){
+        char bytes[2]={byte};
+        Cell cell={0};
+        state_convert_cell(config, state, bytes, 1, &cell);
+        hash=hash_cell(hash, &cell);
+        if (U_SUCCESS(cell.err) && cell.length_utf16) *dead=false;
+        if (cell.length_utf16 || (U_FAILURE(cell.err) && cell.err != U_TRUNCATED_CHAR_FOUND)) continue;
+        for (size_t i=0; i<sizeof(trail_bytes); i++){
+            bytes[1]=trail_bytes[i];
+            cell=(Cell){0};
+            state_convert_cell(config, state, bytes, 2, &cell);
+            hash=hash_cell(hash, &cell);
+            if (U_SUCCESS(cell.err) && cell.length_utf16) *dead=false;
+        }
+    }
+    return hash;
+}
+
+/* Takes the state if it's a new one that something can be converted from */
+static bool add_shift_state(ShiftSearch * search, int origin, size_t length, const ConverterState * state){
+    if (search->count == max_shift_states) return false;
+    bool dead;
+    const uint64_t fingerprint=state_fingerprint(search->config, state, &dead);
+    if (dead) return false;
+    for (int i=0; i<search->count; i++)
+        if (search->states[i].fingerprint == fingerprint) return false;
+    const inbuf_type * from=search->states[origin].path;
+    inbuf_type * path=malloc(sizeof(inbuf_type)+from->index+length);
+    path->capacity=path->index=from->index+length;
+    memcpy(path->buf, from->buf, from->index);
+    memcpy(path->buf+from->index, search->sequence, length);
+    search->states[search->count++]=(ShiftState){.state=*state, .path=path, .fingerprint=fingerprint};
+    return true;
+}
+
+/*
+ * An escape converts to nothing when flushed, and twice in a row too
+ * (ICU calls a redundant escape illegal, which is fine). Converters that
+ * keep half a character to themselves (HZ's ~ and lead bytes) don't
+ * count it as incomplete, but twice it makes a character.
+ */
+static bool is_escape(ShiftSearch * search, int origin, size_t length){
+    const Config config=search->config;
+    const ConverterState * from=&search->states[origin].state;
+    Cell flushed={0};
+    state_convert_cell(config, from, search->sequence, length, &flushed);
+    if (U_FAILURE(flushed.err) || flushed.length_utf16) return false;
+    char twice[2*length];
+    memcpy(twice, search->sequence, length);
+    memcpy(twice+length, search->sequence, length);
+    ConverterState state;
+    UChar units[15];
+    size_t units_length=1;
+    if (state_copy(from, &state))
+        state_feed(config, &state, twice, 2*length, false, units, &units_length);
+    state_close(&state);
+    return !units_length;
+}
+
+/* Tries every byte after the first length bytes of the sequence, which leave the converter at */
+static void find_shifts(ShiftSearch * search, int origin, const ConverterState * at, size_t length){
+    const Config config=search->config;
+    ConverterState next[256];
+    bool incomplete[256]={0};
+    int incomplete_count=0;
+    bool character=false;
+    for (int byte=0; byte<256; byte++){
+        UChar units[15];
+        size_t units_length;
+        if (!state_copy(at, &next[byte])) {
+            state_close(&next[byte]);
+            continue;
+        }
+        search->sequence[length]=byte;
+        const UErrorCode err=state_feed(config, &next[byte], &search->sequence[length], 1, false, units, &units_length);
+        if (units_length) character=true;
+        else if (U_SUCCESS(err) && is_escape(search, origin, length+1)) {
+            if (!add_shift_state(search, origin, length+1, &next[byte])) state_close(&next[byte]);
+            continue;
+        }
+        /* What converts to nothing and isn't an escape is kept back as part of a character */
+        if (!units_length && (U_SUCCESS(err) || err == U_TRUNCATED_CHAR_FOUND)) {
+            incomplete[byte]=true;
+            incomplete_count++;
+        } else state_close(&next[byte]);
+    }
+    for (int byte=0; byte<256; byte++){
+        if (!incomplete[byte]) continue;
+        if (
+            length+1 < config.stateful_depth &&
+            (length == 0 || (length == 1?!character:incomplete_count <= shift_fanout))
+        ) {
+            search->sequence[length]=byte;
+            find_shifts(search, origin, &next[byte], length+1);
+        }
+        state_close(&next[byte]);
+    }
+}
+
+static bool print_stateful(Config config, const inbuf_type * inbuf){
+    ShiftSearch * search=calloc(1, sizeof(ShiftSearch));
+    search->config=config;
+    if (!state_open(config, inbuf, &search->states[0].state)) {
+        fprintf(stderr, "The prefix doesn't leave %s in a state to start from\n", config.codepage);
+        free(search);
+        return false;
+    }
+    inbuf_type * path=malloc(sizeof(inbuf_type)+inbuf->index);
+    path->capacity=path->index=inbuf->index;
+    memcpy(path->buf, inbuf->buf, inbuf->index);
+    search->states[0].path=path;
+    bool dead;
+    search->states[0].fingerprint=state_fingerprint(config, &search->states[0].state, &dead);
+    search->count=1;
+    for (int origin=0; origin < search->count; origin++)
+        find_shifts(search, origin, &search->states[origin].state, 0);
+
+    /* The cells don't depend on the prefix the cache is keyed by */
+    config.cache=NULL;
+    emit_header(config);
+    OutBuf out={0};
+    for (int i=0; i<search->count; i++){
+        if (config.output_format == FORMAT_ANSI) {
+            out.attribute=0;
+            format {
+                out_prefix(&out, search->states[i].path);
+                out_literal(&out, "\n");
+            }
+            out_flush(&out, config.output_fd);
+        }
+        config.state=&search->states[i].state;
+        print_tables(config, search->states[i].path);
+        state_close(&search->states[i].state);
+        free(search->states[i].path);
+    }
+    free(out.buf);
+    free(search);
+    return true;
+}
+
+/*
+ * --reverse: the chart the other way around. Table n holds U+nn00 to
+ * U+nnFF and every cell shows the bytes its code point encodes to. ICU
+ * hands over the set of encodable code points up front, so tables with
+ * nothing in them are never encoded, and a table is encoded with one
+ * ucnv_fromUnicode call whose offsets say which bytes belong to which
+ * code point. iconv has no such set, so each table is run through it once
+ * with //IGNORE and tables where nothing comes out are left out the same
+ * way. Converters that keep state between characters, and the other
+ * backends, encode one code point at a time from the initial state.
+ */
+typedef enum {
+    REVERSE_NONE,
+    REVERSE_ROUNDTRIP,
+    REVERSE_FALLBACK
+} ReverseKind;
+typedef struct {
+    uint8_t bytes[15];
+    uint8_t length;
+    uint8_t kind;
+} ReverseCell;
+typedef struct {
+    void * converter;
+    USet * roundtrip, * fallback;
+    /* Tables with anything encodable in them */
+    bool tables[0x1100];
+} ReverseEncoder;
+
+#if defined(ENABLE_ICONV) || defined(ENABLE_LIBICONV)
+/*
+ * Marks the tables in the range that anything comes out of. An iconv that
+ * stops at a code point it can't encode even with //IGNORE is restarted
+ * past it, and a table it fails on some other way is kept.
+ */
+static void probe_tables(const Config config, ReverseEncoder * encoder, void * probe, iconv_function run){
+    for (int table=config.reverse_from>>8; table <= config.reverse_to>>8; table++){
+        const UChar32 base=table<<8;
+        UChar units[512];
+        int32_t length_utf16=0;
+        for (int i=0; i<256; i++)
+            if (!U_IS_SURROGATE(base+i)) U16_APPEND_UNSAFE(units, length_utf16, base+i);
+        char bytes[256*16];
+        char * inbuf_ptr=(char *)units, * outbuf_ptr=bytes;
+        size_t inbytes_left=length_utf16*sizeof(UChar), outbytes_left=sizeof(bytes);
+        bool failed=false;
+        run(probe, NULL, NULL, NULL, NULL);
+        while (inbytes_left && outbuf_ptr == bytes && !failed){
+            const char * const before=inbuf_ptr;
+            if (run(probe, &inbuf_ptr, &inbytes_left, &outbuf_ptr, &outbytes_left) != (size_t)-1) break;
+            if (errno != EILSEQ) failed=true;
+            else if (inbuf_ptr == before) {
+                const size_t skip=base > 0xffff?2*sizeof(UChar):sizeof(UChar);
+                inbuf_ptr+=skip;
+                inbytes_left-=skip;
+            }
+        }
+        encoder->tables[table]=outbuf_ptr != bytes || failed;
+    }
+}
+#endif
+
+static bool open_reverse_encoder(const Config config, ReverseEncoder * encoder){
+    *encoder=(ReverseEncoder){0};
+    if (config.backend != ICU)
+        memset(encoder->tables, true, sizeof(encoder->tables));
+    switch (config.backend){
+        case ICU: {
+            UErrorCode err=U_ZERO_ERROR;
+            ucnv_setFromUCallBack(config.converter, UCNV_FROM_U_CALLBACK_STOP, NULL, NULL, NULL, &err);
+            ucnv_setFallback(config.converter, true);
+            encoder->converter=config.converter;
+            encoder->roundtrip=uset_openEmpty();
+            encoder->fallback=uset_openEmpty();
+            ucnv_getUnicodeSet(config.converter, encoder->roundtrip, UCNV_ROUNDTRIP_SET, &err);
+            ucnv_getUnicodeSet(config.converter, encoder->fallback, UCNV_ROUNDTRIP_AND_FALLBACK_SET, &err);
+            if (U_FAILURE(err)) {
+                /* No set for this converter, try everything */
+                uset_clear(encoder->roundtrip);
+                uset_clear(encoder->fallback);
+                uset_addRange(encoder->roundtrip, 0, 0x10ffff);
+                uset_addRange(encoder->fallback, 0, 0x10ffff);
+            }
+            for (int32_t i=0; i<uset_getItemCount(encoder->fallback); i++){
+                UChar32 start, end;
+                if (uset_getItem(encoder->fallback, i, &start, &end, NULL, 0, &err) == 0)
+                    for (UChar32 table=start>>8; table <= end>>8; table++)
+                        encoder->tables[table]=true;
+            }
+            return true;
+        }
+        #ifdef ENABLE_ICONV
+        case ICONV: {
+            iconv_t cd=iconv_open(config.codepage, utf16_host_endian());
+            encoder->converter=cd;
+            if (cd == (iconv_t)-1) return false;
+            char tocode[256];
+            if ((size_t)snprintf(tocode, sizeof(tocode), "%s//IGNORE", config.codepage) < sizeof(tocode)) {
+                iconv_t probe=iconv_open(tocode, utf16_host_endian());
+                if (probe != (iconv_t)-1) {
+                    probe_tables(config, encoder, probe, (iconv_function)iconv);
+                    iconv_close(probe);
+                }
+            }
+            return true;
+        }
+        #endif
+        #ifdef ENABLE_LIBICONV
+        case LIBICONV: {
+            void * cd=libiconv_open(config.codepage, utf16_host_endian());
+            encoder->converter=cd;
+            if (cd == (void *)-1) return false;
+            char tocode[256];
+            if ((size_t)snprintf(tocode, sizeof(tocode), "%s//IGNORE", config.codepage) < sizeof(tocode)) {
+                void * probe=libiconv_open(tocode, utf16_host_endian());
+                if (probe != (void *)-1) {
+                    probe_tables(config, encoder, probe, (iconv_function)libiconv);
+                    libiconv_close(probe);
+                }
+            }
+            return true;
+        }
+        #endif
+        case LOCALE:
+            return true;
+        /* --mapfile and --gconv are turned down when the options are parsed */
+        default:
+            return false;
+    }
+}
+
+static void close_reverse_encoder(const Config config, ReverseEncoder * encoder){
+    switch (config.backend){
+        case ICU:
+            uset_close(encoder->roundtrip);
+            uset_close(encoder->fallback);
+        break;
+        #ifdef ENABLE_ICONV
+        case ICONV:
+            iconv_close(encoder->converter);
+        break;
+        #endif
+        #ifdef ENABLE_LIBICONV
+        case LIBICONV:
+            libiconv_close(encoder->converter);
+        break;
+        #endif
+        default:
+        break;
+    }
+}
+
+static void encode_codepoint(const Config config, const ReverseEncoder * encoder, UChar32 codepoint, ReverseCell * cell){
+    UChar units[2];
+    int32_t length_utf16=0;
+    U16_APPEND_UNSAFE(units, length_utf16, codepoint);
+    cell->length=0;
+    cell->kind=REVERSE_NONE;
+    switch (config.backend){
+        case ICU: {
+            UErrorCode err=U_ZERO_ERROR;
+            const int32_t length=ucnv_fromUChars(
+                encoder->converter,
+                (char *)cell->bytes,
+                sizeof(cell->bytes),
+                units,
+                length_utf16,
+                &err
+            );
+            if (U_FAILURE(err) || err == U_STRING_NOT_TERMINATED_WARNING) return;
+            cell->length=length;
+            cell->kind=uset_contains(encoder->roundtrip, codepoint)?REVERSE_ROUNDTRIP:REVERSE_FALLBACK;
+        } break;
+        #ifdef ENABLE_ICONV
+        case ICONV: {
+            char * inbuf_ptr=(char *)units, * outbuf_ptr=(char *)cell->bytes;
+            size_t inbytes_left=length_utf16*sizeof(UChar), outbytes_left=sizeof(cell->bytes);
+            iconv(encoder->converter, NULL, NULL, NULL, NULL);
+            if (
+                iconv(encoder->converter, &inbuf_ptr, &inbytes_left, &outbuf_ptr, &outbytes_left) == (size_t)-1 ||
+                iconv(encoder->converter, NULL, NULL, &outbuf_ptr, &outbytes_left) == (size_t)-1
+            ) return;
+            cell->length=outbuf_ptr-(char *)cell->bytes;
+            cell->kind=REVERSE_ROUNDTRIP;
+        } break;
+        #endif
+        #ifdef ENABLE_LIBICONV
+        case LIBICONV: {
+            char * inbuf_ptr=(char *)units, * outbuf_ptr=(char *)cell->bytes;
+            size_t inbytes_left=length_utf16*sizeof(UChar), outbytes_left=sizeof(cell->bytes);
+            libiconv(encoder->converter, NULL, NULL, NULL, NULL);
+            if (
+                libiconv(encoder->converter, &inbuf_ptr, &inbytes_left, &outbuf_ptr, &outbytes_left) == (size_t)-1 ||
+                libiconv(encoder->converter, NULL, NULL, &outbuf_ptr, &outbytes_left) == (size_t)-1
+            ) return;
+            cell->length=outbuf_ptr-(char *)cell->bytes;
+            cell->kind=REVERSE_ROUNDTRIP;
+        } break;
+        #endif
+        case LOCALE: {
+            char mb[MB_LEN_MAX];
+            mbstate_t mbstate={0};
+            const locale_t previous=uselocale(((const LocaleConverter *)config.converter)->locale);
+            const size_t length=c32rtomb(mb, codepoint, &mbstate);
+            uselocale(previous);
+            if (length == (size_t)-1 || length > sizeof(cell->bytes)) return;
+            memcpy(cell->bytes, mb, length);
+            cell->length=length;
+            cell->kind=REVERSE_ROUNDTRIP;
+        } break;
+        default:
+        break;
+    }
+}
+
+static void encode_table(const Config config, const ReverseEncoder * encoder, int table, ReverseCell cells[256]){
+    const UChar32 base=table<<8;
+    if (config.backend != ICU || !icu_batchable(encoder->converter) || (base >= 0xd800 && base < 0xe000)) {
+        for (int i=0; i<256; i++){
+            cells[i]=(ReverseCell){0};
+            if (!U_IS_SURROGATE(base+i) && (config.backend != ICU || uset_contains(encoder->fallback, base+i)))
+                encode_codepoint(config, encoder, base+i, &cells[i]);
+        }
+        return;
+    }
+    UChar units[512];
+    uint8_t unit_cell[512];
+    int32_t length_utf16=0;
+    for (int i=0; i<256; i++){
+        cells[i]=(ReverseCell){0};
+        if (!uset_contains(encoder->fallback, base+i)) continue;
+        const int32_t start=length_utf16;
+        U16_APPEND_UNSAFE(units, length_utf16, base+i);
+        for (int32_t u=start; u<length_utf16; u++) unit_cell[u]=i;
+        cells[i].kind=uset_contains(encoder->roundtrip, base+i)?REVERSE_ROUNDTRIP:REVERSE_FALLBACK;
+    }
+    enum {bytes_capacity=256*16};
+    char bytes[bytes_capacity];
+    int32_t offsets[bytes_capacity];
+    char * target=bytes;
+    const UChar * source=units;
+    UErrorCode err=U_ZERO_ERROR;
+    ucnv_resetFromUnicode(encoder->converter);
+    ucnv_fromUnicode(
+        encoder->converter,
+        &target,
+        bytes+bytes_capacity,
+        &source,
+        units+length_utf16,
+        offsets,
+        true,
+        &err
+    );
+    bool overflow=false;
+    /* Bytes with no unit of their own (a shift back at the end) make it ambiguous */
+    if (U_SUCCESS(err)) for (int32_t j=0; j<target-bytes; j++){
+        if (offsets[j] < 0) {
+            overflow=true;
+            break;
+        }
+        ReverseCell * cell=&cells[unit_cell[offsets[j]]];
+        if (cell->length == sizeof(cell->bytes)) {
+            overflow=true;
+            break;
+        }
+        cell->bytes[cell->length++]=bytes[j];
+    }
+    if (U_FAILURE(err) || overflow)
+        for (int i=0; i<256; i++)
+            if (cells[i].kind != REVERSE_NONE)
+                encode_codepoint(config, encoder, base+i, &cells[i]);
+}
+
+static void print_reverse_table(const Config config, int table, const ReverseCell cells[256], OutBuf * out){
+    if (config.no_format_bool) {
+        for (int i=0; i<256; i++)
+            out_append(out, (const char *)cells[i].bytes, cells[i].length);
+        return;
+    }
+    int width=2;
+    for (int i=0; i<256; i++)
+        if (2*cells[i].length > width) width=2*cells[i].length;
+    out->attribute=0;
+    out_literal(out, "Table ");
+    out_codepoint(out, table<<8);
+    out_literal(out, ":\n  \e[7m");
+    for (int i=0; i<16; i++){
+        out_char(out, hex_digits[i]);
+        for (int pad=0; pad<width; pad++) out_char(out, ' ');
+    }
+    out_literal(out, "\e[27m\n\n");
+    for (int i=0; i<16; i++){
+        out_append(out, row_labels[i], sizeof(row_labels[i])-1);
+        for (int j=0; j<16; j++){
+            const int x=config.column_order?i:j;
+            const int y=config.column_order?j:i;
+            const ReverseCell * cell=&cells[y*16+x];
+            const UChar32 codepoint=(table<<8)+y*16+x;
+            int attribute=attribute_default_background;
+            if (cell->kind == REVERSE_NONE) attribute=attribute_red_background;
+            else if (cell->kind == REVERSE_FALLBACK) attribute=attribute_yellow_background;
+            else if (cp_flags(codepoint) & CP_CONTROL) attribute=attribute_blue_background;
+            else if (cp_flags(codepoint) & CP_PUA) attribute=attribute_magenta_background;
+            attrSet(out, attribute);
+            for (int k=0; k<cell->length; k++){
+                out_char(out, hex_digits[cell->bytes[k]>>4]);
+                out_char(out, hex_digits[cell->bytes[k]&15]);
+            }
+            for (int pad=2*cell->length; pad<width; pad++) out_char(out, ' ');
+            attrSet(out, attribute_default_background);
+            out_char(out, ' ');
+        }
+        attrReset(out, "\n");
+    }
+    attrReset(out, "\n");
+}
+
+static void print_reverse(const Config config){
+    ReverseEncoder encoder;
+    if (!open_reverse_encoder(config, &encoder)) {
+        fprintf(stderr, "This backend can't encode %s\n", config.codepage);
+        return;
+    }
+    const int from_table=config.reverse_from>>8, to_table=config.reverse_to>>8;
+    ReverseCell cells[256];
+    OutBuf out={0};
+    for (int table=from_table; table <= to_table; table++){
+        const UChar32 base=table<<8;
+        if (!encoder.tables[table]) {
+            /* Nothing to encode, one line for the whole run */
+            if (config.no_format_bool) continue;
+            int last=table;
+            while (last < to_table && !encoder.tables[last+1])
+                last++;
+            out_str(&out, last == table?"Table ":"Tables ");
+            out_codepoint(&out, base);
+            if (last != table) {
+                out_char(&out, '-');
+                out_codepoint(&out, (last<<8)+255);
+            }
+            out_literal(&out, ": nothing encodable\n\n");
+            out_flush(&out, config.output_fd);
+            table=last;
+            continue;
+        }
+        encode_table(config, &encoder, table, cells);
+        print_reverse_table(config, table, cells, &out);
+        out_flush(&out, config.output_fd);
+    }
+    free(out.buf);
+    close_reverse_encoder(config, &encoder);
+}
+
+/*
+ * --diff: convert every cell with both converters and report only the
+ * ones where they disagree, as a chart per table with differences and a
+ * tab separated list of bytes, left and right. With -n only the list is
+ * printed.
+ */
+static bool cells_differ(const Cell * a, const Cell * b){
+    const CellClass class=cell_class(a);
+    if (class != cell_class(b)) return true;
+    if (class == CELL_ERROR) return a->err != b->err;
+    return class == CELL_VALID && (
+        a->length_utf16 != b->length_utf16 ||
+        memcmp(a->str_utf16, b->str_utf16, a->length_utf16*sizeof(UChar))
+    );
+}
+
+static void out_cell_value(OutBuf * out, const Cell * cell){
+    switch (cell_class(cell)){
+        case CELL_VALID:
+            if (!cell->length_utf16) out_literal(out, "empty");
+            for (int32_t i=0; i<cell->length_utf16;){
+                UChar32 c;
+                if (i) out_char(out, ' ');
+                U16_NEXT(cell->str_utf16, i, cell->length_utf16, c);
+                out_codepoint(out, c);
+            }
+        break;
+        case CELL_INVALID:
+            out_literal(out, "invalid");
+        break;
+        case CELL_TRUNCATED:
+            out_literal(out, "truncated");
+        break;
+        case CELL_ERROR:
+            out_str(out, u_errorName(cell->err));
+        break;
+    }
+}
+
+#endif
+
+/* Every compiled in backend by the name --diff and --benchmark know it by */
+static const struct {
+    const char * name;
+    Backend backend;
+} backends[]={
+    {"icu", ICU},
+    #ifdef ENABLE_ICONV
+    {"iconv", ICONV},
+    #endif
+    #ifdef ENABLE_LIBICONV
+    {"libiconv", LIBICONV},
+    #endif
+    #ifdef ENABLE_GCONV
+    {"gconv", GCONV},
+    #endif
+    {"mapfile", MAPPING_FILE},
+    {"locale", LOCALE}
+};
+
+#ifndef CPDISP_LIBRARY
+/* "[backend:]name", the backend defaults to the one charted */
+static bool parse_diff_target(const Config config, Config * other){
+    *other=config;
+    other->codepage=config.diff_target;
+    other->cache=NULL;
+    const char * colon=strchr(config.diff_target, ':');
+    const size_t name_length=colon?(size_t)(colon-config.diff_target):0;
+    if (colon) for (size_t i=0; i<sizeof(backends)/sizeof(backends[0]); i++)
+        if (
+            strlen(backends[i].name) == name_length &&
+            !strncmp(backends[i].name, config.diff_target, name_length)
+        ) {
+            other->backend=backends[i].backend;
+            other->codepage=colon+1;
+        }
+    const char * errmsg=open_converter(other);
+    if (errmsg) {
+        fprintf(stderr, errmsg, other->codepage);
+        return false;
+    }
+    return true;
+}
+
+/* Returns the number of cells that differ, or -1 if the other side can't be opened */
+static long print_diff(const Config config, const inbuf_type * inbuf){
+    Config other;
+    if (!parse_diff_target(config, &other)) return -1;
+    Cell left[256], right[256];
+    OutBuf out={0}, list={0};
+    long total=0;
+    int tables=0;
+    format {
+        out_literal(&out, "Left: ");
+        out_str(&out, config.codepage);
+        out_literal(&out, ", right: ");
+        out_str(&out, config.diff_target);
+        out_literal(&out, "\n* different characters, < only left converts, > only right converts, ! different errors\n\n");
+    }
+    for (int table=config.from_table; table <= config.to_table; table++){
+        convert_table(config, inbuf, table, left);
+        convert_table(other, inbuf, table, right);
+        int differences=0;
+        for (int i=0; i<256; i++)
+            if (cells_differ(&left[i], &right[i])) differences++;
+        if (!differences) continue;
+        total+=differences;
+        tables++;
+        out.attribute=0;
+        format {
+            out_literal(&out, "Table ");
+            out_uint(&out, table);
+            out_literal(&out, ": ");
+            out_uint(&out, differences);
+            out_str(&out, differences == 1?" difference\n":" differences\n");
+            out_literal(&out, "  \e[7m0 1 2 3 4 5 6 7 8 9 a b c d e f \e[27m\n\n");
+            for (int i=0; i<16; i++){
+                out_append(&out, row_labels[i], sizeof(row_labels[i])-1);
+                for (int j=0; j<16; j++){
+                    const int x=config.column_order?i:j;
+                    const int y=config.column_order?j:i;
+                    const Cell * a=&left[y*16+x], * b=&right[y*16+x];
+                    if (!cells_differ(a, b)) {
+                        attrPrint(&out, attribute_default_background, "· ");
+                        continue;
+                    }
+                    const CellClass class_a=cell_class(a), class_b=cell_class(b);
+                    if (class_a == class_b)
+                        attrPrint(&out, attribute_yellow_background, "* ");
+                    else if (class_a == CELL_VALID)
+                        attrPrint(&out, attribute_red_background, "< ");
+                    else if (class_b == CELL_VALID)
+                        attrPrint(&out, attribute_red_background, "> ");
+                    else
+                        attrPrint(&out, attribute_red_background, "! ");
+                }
+                attrReset(&out, "\n");
+            }
+            out_char(&out, '\n');
+        }
+        for (int i=0; i<256; i++){
+            if (!cells_differ(&left[i], &right[i])) continue;
+            for (size_t j=0; j<inbuf->index; j++){
+                out_char(&list, hex_digits[(unsigned char)inbuf->buf[j]>>4]);
+                out_char(&list, hex_digits[inbuf->buf[j]&15]);
+            }
+            if (config.wide) {
+                out_char(&list, hex_digits[table>>4]);
+                out_char(&list, hex_digits[table&15]);
+            }
+            out_char(&list, hex_digits[i>>4]);
+            out_char(&list, hex_digits[i&15]);
+            out_char(&list, '\t');
+            out_cell_value(&list, &left[i]);
+            out_char(&list, '\t');
+            out_cell_value(&list, &right[i]);
+            out_char(&list, '\n');
+        }
+        format {
+            out_append(&out, list.buf, list.length);
+            out_char(&out, '\n');
+            list.length=0;
+        }
+        out_flush(&out, config.output_fd);
+    }
+    out_flush(&list, config.output_fd);
+    format {
+        out_uint(&out, total);
+        out_str(&out, total == 1?" cell differs in ":" cells differ in ");
+        out_uint(&out, tables);
+        out_str(&out, tables == 1?" table\n":" tables\n");
+        out_flush(&out, config.output_fd);
+    }
+    free(out.buf);
+    free(list.buf);
+    close_converter(other);
+    return total;
+}
+
+/*
+ * --heatmap: count how often every cell occurs in a file and shade the
+ * chart by it. Without -w every byte is counted. With -w the file is
+ * walked the way the encoding splits it, as far as lead bytes go: a lead
+ * byte is counted together with the byte after it, anything else on its
+ * own, so longer sequences count as their first two bytes and then as
+ * whatever follows. Big files are split between -j threads, each
+ * starting after a byte that can't be a trail byte.
+ */
+typedef struct {
+    uint64_t single[256];
+    uint64_t pairs[65536];
+} Histogram;
+typedef struct {
+    const unsigned char * data;
+    size_t start, end, size;
+    const bool * starters;
+    Histogram * histogram;
+} HeatChunk;
+
+/* Four sets of counters so consecutive equal bytes don't wait on each other */
+static void count_bytes(const unsigned char * data, size_t length, uint64_t counts[256]){
+    while (length) {
+        uint32_t partial[4][256]={0};
+        const size_t block=length < (1u<<30)?length:(1u<<30);
+        size_t i=0;
+        for (; i+8 <= block; i+=8){
+            uint64_t word;
+            memcpy(&word, data+i, 8);
+            partial[0][word&0xff]++;
+            partial[1][(word>>8)&0xff]++;
+            partial[2][(word>>16)&0xff]++;
+            partial[3][(word>>24)&0xff]++;
+            partial[0][(word>>32)&0xff]++;
+            partial[1][(word>>40)&0xff]++;
+            partial[2][(word>>48)&0xff]++;
+            partial[3][word>>56]++;
+        }
+        for (; i<block; i++) partial[0][data[i]]++;
+        for (int b=0; b<256; b++)
+            counts[b]+=partial[0][b]+partial[1][b]+partial[2][b]+partial[3][b];
+        data+=block;
+        length-=block;
+    }
+}
+
+static int count_chunk(void * arg){
+    HeatChunk * chunk=arg;
+    const unsigned char * data=chunk->data;
+    Histogram * histogram=chunk->histogram;
+    if (!chunk->starters) {
+        count_bytes(data+chunk->start, chunk->end-chunk->start, histogram->single);
+        return 0;
+    }
+    size_t i=chunk->start;
+    while (i < chunk->end){
+        /* Runs of bytes that aren't lead bytes go through the fast counter */
+        size_t run=i;
+        while (run < chunk->end && !chunk->starters[data[run]]) run++;
+        if (run-i >= 1024) {
+            count_bytes(data+i, run-i, histogram->single);
+            i=run;
+        } else for (; i<run; i++)
+            histogram->single[data[i]]++;
+        if (i >= chunk->end) break;
+        if (i+1 < chunk->size) {
+            histogram->pairs[data[i]<<8|data[i+1]]++;
+            i+=2;
+        } else
+            histogram->single[data[i++]]++;
+    }
+    return 0;
+}
+
+/* Where a chunk starting near offset should really start */
+static size_t heat_resync(const unsigned char * data, size_t offset, size_t size, const bool * starters, bool fixed_width){
+    if (!starters) return offset;
+    if (fixed_width) return offset&~(size_t)1;
+    while (offset < size && (data[offset] >= 0x40 || starters[data[offset]])) offset++;
+    return offset < size?offset+1:size;
+}
+
+static void count_file(const Config config, const unsigned char * data, size_t size, const bool * starters, Histogram * histogram){
+    bool fixed_width=starters != NULL;
+    for (int b=0; starters && b<256; b++) fixed_width&=starters[b];
+    int jobs=size < (64<<20)?1:config.jobs;
+    HeatChunk chunks[jobs];
+    Histogram * partial[jobs];
+    thrd_t threads[jobs];
+    size_t start=0;
+    for (int k=0; k<jobs; k++){
+        const size_t end=k+1 == jobs?size:heat_resync(data, size/jobs*(k+1), size, starters, fixed_width);
+        partial[k]=k?calloc(1, sizeof(Histogram)):histogram;
+        chunks[k]=(HeatChunk){
+            .data=data,
+            .start=start,
+            .end=end<start?start:end,
+            .size=size,
+            .starters=starters,
+            .histogram=partial[k]
+        };
+        start=chunks[k].end;
+    }
+    int started=1;
+    while (started < jobs && thrd_create(&threads[started], count_chunk, &chunks[started]) == thrd_success)
+        started++;
+    count_chunk(&chunks[0]);
+    for (int k=started; k<jobs; k++) count_chunk(&chunks[k]);
+    for (int k=1; k<jobs; k++){
+        if (k < started) thrd_join(threads[k], NULL);
+        for (int b=0; b<256; b++) histogram->single[b]+=partial[k]->single[b];
+        for (int b=0; b<65536; b++) histogram->pairs[b]+=partial[k]->pairs[b];
+        free(partial[k]);
+    }
+}
+
+/* Pipes and the like, a lead byte at the end of a block waits for the next one */
+static bool count_stream(int fd, const bool * starters, Histogram * histogram){
+    enum {block_size=1<<20};
+    unsigned char * block=malloc(block_size+1);
+    size_t carried=0;
+    for (;;) {
+        const ssize_t result=read(fd, block+carried, block_size);
+        if (result < 0 && errno == EINTR) continue;
+        if (result < 0) {
+            free(block);
+            return false;
+        }
+        const size_t length=carried+result;
+        carried=0;
+        if (result && starters && starters[block[length-1]]) {
+            /* Leave it for the next block unless it's the last lead byte of a run */
+            size_t run=length;
+            while (run > 0 && starters[block[run-1]]) run--;
+            if ((length-run)&1) carried=1;
+        }
+        HeatChunk chunk={
+            .data=block,
+            .start=0,
+            .end=length-carried,
+            .size=length-carried,
+            .starters=starters,
+            .histogram=histogram
+        };
+        count_chunk(&chunk);
+        if (carried) block[0]=block[length-1];
+        if (!result) break;
+    }
+    free(block);
+    return true;
+}
+
+/* Shade for count on a log scale up to max, 0 for cells that never occur */
+static int heat_attribute(uint64_t count, uint64_t max){
+    enum {first_shade=236, shades=20};
+    if (!count) return 0;
+    const int bits=64-__builtin_clzll(count), max_bits=64-__builtin_clzll(max);
+    return attribute_256_background+first_shade+(shades-1)*bits/max_bits;
+}
+
+static void print_heat_footer(const Cell cells[256], const uint64_t counts[256], OutBuf * out){
+    uint64_t total=0, classes[4]={0}, control=0, pua=0;
+    for (int i=0; i<256; i++){
+        total+=counts[i];
+        classes[cell_class(&cells[i])]+=counts[i];
+        if (cell_class(&cells[i]) != CELL_VALID) continue;
+        if (cells[i].flags & CP_CONTROL) control+=counts[i];
+        if (cells[i].flags & CP_PUA) pua+=counts[i];
+    }
+    static const char * const labels[]={" total, ", " valid, ", " invalid, ", " truncated, ", " control, ", " private use\n\n"};
+    const uint64_t values[]={total, classes[CELL_VALID], classes[CELL_INVALID], classes[CELL_TRUNCATED], control, pua};
+    out_literal(out, "Occurrences: ");
+    for (int i=0; i<6; i++){
+        char number[24];
+        sprintf(number, "%llu", (unsigned long long)values[i]);
+        out_str(out, number);
+        out_str(out, labels[i]);
+    }
+}
+
+static void print_heat_table(const Config config, const inbuf_type * inbuf, int table, const uint64_t counts[256], uint64_t max, OutBuf * out){
+    Cell cells[256];
+    convert_table(config, inbuf, table, cells);
+    for (int i=0; i<256; i++) classify_cell(&cells[i]);
+    if (config.no_format_bool) {
+        for (int i=0; i<256; i++){
+            if (!counts[i]) continue;
+            if (config.wide) {
+                out_char(out, hex_digits[table>>4]);
+                out_char(out, hex_digits[table&15]);
+            }
+            out_char(out, hex_digits[i>>4]);
+            out_char(out, hex_digits[i&15]);
+            char number[24];
+            sprintf(number, "\t%llu\n", (unsigned long long)counts[i]);
+            out_str(out, number);
+        }
+        return;
+    }
+    int heat[256];
+    for (int i=0; i<256; i++) heat[i]=heat_attribute(counts[i], max);
+    out->attribute=0;
+    if (config.wide) {
+        out_literal(out, "Table ");
+        out_uint(out, table);
+    } else
+        out_literal(out, "Single bytes");
+    out_literal(out, ":\n");
+    print_cells(config, cells, heat, out);
+    print_heat_footer(cells, counts, out);
+}
+
+static bool print_heatmap(Config config){
+    int fd=strcmp(config.heatmap_file, "-")?open(config.heatmap_file, O_RDONLY):STDIN_FILENO;
+    if (fd < 0) {
+        fprintf(stderr, "Can't open %s\n", config.heatmap_file);
+        return false;
+    }
+    /* Counted from the start of the file, so no -x prefix */
+    const inbuf_type empty={0};
+    bool starters_buffer[256], * starters=NULL;
+    if (config.wide) {
+        uint8_t table_kinds[256];
+        find_dead_tables(config, &empty, table_kinds);
+        for (int b=0; b<256; b++) starters_buffer[b]=table_kinds[b] == TABLE_LIVE;
+        starters=starters_buffer;
+    }
+    Histogram * histogram=calloc(1, sizeof(Histogram));
+    struct stat st;
+    void * data=MAP_FAILED;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0)
+        data=mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    bool ok=true;
+    if (data != MAP_FAILED) {
+        madvise(data, st.st_size, MADV_SEQUENTIAL);
+        count_file(config, data, st.st_size, starters, histogram);
+        munmap(data, st.st_size);
+    } else
+        ok=count_stream(fd, starters, histogram);
+    if (fd != STDIN_FILENO) close(fd);
+    if (!ok) {
+        fprintf(stderr, "Can't read %s\n", config.heatmap_file);
+        free(histogram);
+        return false;
+    }
+
+    uint64_t max=1;
+    for (int b=0; b<256; b++) if (histogram->single[b] > max) max=histogram->single[b];
+    for (int b=0; b<65536; b++) if (histogram->pairs[b] > max) max=histogram->pairs[b];
+    OutBuf out={0};
+    Config single=config;
+    single.wide=false;
+    print_heat_table(single, &empty, 0, histogram->single, max, &out);
+    out_flush(&out, config.output_fd);
+    for (int table=config.from_table; config.wide && table <= config.to_table; table++){
+        const uint64_t * counts=&histogram->pairs[table<<8];
+        bool any=false;
+        for (int i=0; i<256; i++) any|=counts[i] != 0;
+        if (!any) continue;
+        print_heat_table(config, &empty, table, counts, max, &out);
+        out_flush(&out, config.output_fd);
+    }
+    free(out.buf);
+    free(histogram);
+    return true;
+}
+
+/*
+ * --validate: report every offset in a file where the data doesn't
+ * convert cleanly, in the chart's categories: invalid, truncated (at the
+ * end of the file), undefined, private use, or some other error. ICU
+ * converts the file in slices with offsets, keeping its state between
+ * them. The other backends step through it one character at a time with
+ * validate_step, iconv and gconv from the state the last character left
+ * them in. If every byte below 0x80 is a character of its own and the
+ * converter keeps no state, runs of them that start on a character
+ * boundary are skipped without converting them.
+ *
+ * --detect runs the same thing quietly, also counts control characters
+ * that aren't whitespace, and gives up once more problems than *best
+ * have been found.
+ */
+typedef struct {
+    Config config;
+    bool ascii_fast_path;
+    bool detect;
+    const _Atomic uint64_t * best;
+    uint64_t problems;
+    uint64_t counts[6];
+    OutBuf report;
+    /* Set once validate_block_cells has put iconv in the initial state */
+    bool started;
+    #ifdef ENABLE_GCONV
+    __mbstate_t gconv;
+    #endif
+} Validator;
+enum {
+    VALIDATE_INVALID,
+    VALIDATE_TRUNCATED,
+    VALIDATE_UNDEFINED,
+    VALIDATE_PUA,
+    VALIDATE_ERROR,
+    VALIDATE_CONTROL
+};
+static const char * const validate_category_names[]={
+    [VALIDATE_INVALID]="invalid",
+    [VALIDATE_TRUNCATED]="truncated",
+    [VALIDATE_UNDEFINED]="undefined",
+    [VALIDATE_PUA]="private use",
+    [VALIDATE_ERROR]="error",
+    [VALIDATE_CONTROL]="control"
+};
+
+/* Bytes the fast path skips: below 0x80, or printable ASCII when controls count */
+static inline bool ascii_byte(unsigned char c, bool printable){
+    return printable?c-0x20u < 0x5f:c < 0x80;
+}
+
+/* Length of the run of ascii_bytes at the start of data */
+static size_t ascii_run(const unsigned char * data, size_t length, bool printable){
+    size_t i=0;
+    #ifdef __SSE2__
+    for (; i+16 <= length; i+=16){
+        const __m128i bytes=_mm_loadu_si128((const __m128i *)(data+i));
+        /* Signed, so everything from 0x80 up is below 0x20 too */
+        const int mask=_mm_movemask_epi8(printable?_mm_or_si128(
+            _mm_cmplt_epi8(bytes, _mm_set1_epi8(0x20)),
+            _mm_cmpeq_epi8(bytes, _mm_set1_epi8(0x7f))
+        ):bytes);
+        if (mask) return i+__builtin_ctz(mask);
+    }
+    #endif
+    if (!printable) for (; i+8 <= length; i+=8){
+        uint64_t word;
+        memcpy(&word, data+i, 8);
+        if (word & UINT64_C(0x8080808080808080)) break;
+    }
+    while (i < length && ascii_byte(data[i], printable)) i++;
+    return i;
+}
+
+static bool validate_gave_up(const Validator * validator){
+    return validator->best && validator->problems > atomic_load_explicit(validator->best, memory_order_relaxed);
+}
+
+static void validate_report(Validator * validator, int category, uint64_t offset, const unsigned char * bytes, size_t length, UChar32 codepoint, UErrorCode err){
+    OutBuf * out=&validator->report;
+    validator->counts[category]++;
+    validator->problems++;
+    if (validator->detect) return;
+    char number[24];
+    sprintf(number, "%llu\t", (unsigned long long)offset);
+    out_str(out, number);
+    out_str(out, validate_category_names[category]);
+    out_char(out, '\t');
+    if (bytes) for (size_t i=0; i<length; i++){
+        out_char(out, hex_digits[bytes[i]>>4]);
+        out_char(out, hex_digits[bytes[i]&15]);
+    } else
+        out_codepoint(out, codepoint);
+    if (category == VALIDATE_ERROR) {
+        out_char(out, '\t');
+        out_str(out, u_errorName(err));
+    }
+    out_char(out, '\n');
+    if (out->length >= 1<<16) out_flush(out, validator->config.output_fd);
+}
+
+static void validate_codepoint(Validator * validator, uint64_t offset, UChar32 codepoint){
+    const uint8_t flags=cp_flags(codepoint);
+    if (flags & CP_UNDEFINED)
+        validate_report(validator, VALIDATE_UNDEFINED, offset, NULL, 0, codepoint, U_ZERO_ERROR);
+    else if (flags & CP_PUA)
+        validate_report(validator, VALIDATE_PUA, offset, NULL, 0, codepoint, U_ZERO_ERROR);
+    else if (validator->detect && (flags & (CP_CONTROL|CP_WHITESPACE)) == CP_CONTROL)
+        validate_report(validator, VALIDATE_CONTROL, offset, NULL, 0, codepoint, U_ZERO_ERROR);
+}
+
+static int validate_category(UErrorCode err){
+    switch (cell_class(&(Cell){.err=err})){
+        case CELL_INVALID: return VALIDATE_INVALID;
+        case CELL_TRUNCATED: return VALIDATE_TRUNCATED;
+        default: return VALIDATE_ERROR;
+    }
+}
 
-        case LOCALE:
-        if (setlocale(LC_CTYPE,argv[optind])==NULL) {
-            errmsg="No such locale %s\n";
-            config.fail=true;
-            goto end;
+/* Converts a block at base, returns how much of it was used; the rest has to come again with more data */
+static size_t validate_block_icu(Validator * validator, const unsigned char * data, size_t length, uint64_t base, bool last){
+    UConverter * converter=validator->config.converter;
+    enum {slice_size=4096, units_capacity=2*slice_size};
+    UChar units[units_capacity];
+    int32_t offsets[units_capacity];
+    const bool printable=validator->detect;
+    size_t pos=0;
+    while (
+        !validate_gave_up(validator) &&
+        (pos < length || (last && ucnv_toUCountPending(converter, &idc) > 0))
+    ){
+        idc=U_ZERO_ERROR;
+        const int32_t pending=ucnv_toUCountPending(converter, &idc);
+        idc=U_ZERO_ERROR;
+        if (validator->ascii_fast_path && pending == 0) {
+            pos+=ascii_run(data+pos, length-pos, printable);
+            if (pos == length && !last) break;
         }
-        #ifdef ENABLE_GCONV
-        case GCONV:{
-            void * shared_object=dlopen(argv[optind],RTLD_NOW);
-            if (!shared_object) {
-                errmsg="dlopen failed %s\n";
-                config.fail=true;
-                goto end;
-            }
-            __gconv_init_fct gconv_init=dlsym(shared_object,"gconv_init");
-            __gconv_fct gconv_gconv=dlsym(shared_object,"gconv");
-            __gconv_end_fct gconv_end=dlsym(shared_object,"gconv_end");
-            if (!gconv_gconv || !gconv_init || !gconv_end) {
-                errmsg="Shared object isn't a gconv library %s\n";
-                dlclose(shared_object);
-                config.fail=1;
-                goto end;
-            }
-            gconv_nonsense * gconv = malloc(sizeof(gconv_nonsense));
-            *gconv=(gconv_nonsense){
-                .shared_object=shared_object,
-                .gconv=gconv_gconv,
-                .gconv_end=gconv_end
-            };
-            gconv_init(&gconv->step);
-            config.converter=gconv;
+        size_t end=length-pos > slice_size?pos+slice_size:length;
+        /* Stop in front of the next long ASCII run so it can be skipped */
+        if (validator->ascii_fast_path)
+            for (size_t block=pos+16; block+16 <= end; block+=16)
+                if (ascii_run(data+block, 16, printable) == 16) {
+                    end=block;
+                    break;
+                }
+        const char * source=(const char *)data+pos;
+        UChar * target=units;
+        UErrorCode err=U_ZERO_ERROR;
+        ucnv_toUnicode(
+            converter,
+            &target,
+            units+units_capacity,
+            &source,
+            (const char *)data+end,
+            offsets,
+            last && end == length,
+            &err
+        );
+        const int32_t count=target-units;
+        for (int32_t u=0; u<count;){
+            const int32_t offset=offsets[u];
+            UChar32 c;
+            U16_NEXT(units, u, count, c);
+            validate_codepoint(validator, offset < 0?base+pos-pending:base+pos+offset, c);
+        }
+        const size_t stop=source-(const char *)data;
+        if (U_FAILURE(err) && err != U_BUFFER_OVERFLOW_ERROR) {
+            char invalid[32];
+            int8_t invalid_length=sizeof(invalid);
+            ucnv_getInvalidChars(converter, invalid, &invalid_length, &idc);
+            idc=U_ZERO_ERROR;
+            validate_report(
+                validator,
+                validate_category(err),
+                base+stop-invalid_length,
+                (const unsigned char *)invalid,
+                invalid_length,
+                0,
+                err
+            );
+            ucnv_resetToUnicode(converter);
+        }
+        pos=stop;
+        if (last && end == length && U_SUCCESS(err)) break;
+    }
+    return pos;
+}
 
+#if defined(ENABLE_ICONV) || defined(ENABLE_LIBICONV)
+/*
+ * Room for one more unit at a time until the first character fits, so
+ * iconv stops right after it. An incomplete character is left unread.
+ * glibc converts as much input as it's given before it finds the output
+ * full, so it only gets as much as a character (and its escape sequence)
+ * can take.
+ */
+static size_t iconv_step(iconv_function convert, void * cd, const unsigned char * data, size_t length, Cell * cell){
+    enum {max_length=16};
+    const bool capped=length > max_length;
+    if (capped) length=max_length;
+    for (size_t capacity=1; capacity <= 15; capacity++){
+        char * in=(char *)data, * out=(char *)cell->str_utf16;
+        size_t in_left=length, out_left=capacity*sizeof(UChar);
+        const bool stopped=convert(cd, &in, &in_left, &out, &out_left) == (size_t)-1;
+        const size_t used=in-(char *)data;
+        cell->length_utf16=capacity-out_left/sizeof(UChar);
+        if (used || !stopped) return used;
+        if (errno == E2BIG) continue;
+        if (errno == EINVAL && !capped) {
+            cell->err=U_TRUNCATED_CHAR_FOUND;
+            return 0;
         }
-        break;
+        cell->err=errno == EILSEQ?U_ILLEGAL_CHAR_FOUND:U_STANDARD_ERROR_LIMIT;
+        if (errno != EILSEQ) return 1;
+        /* Neither error moves the state, so see how long the start of a character it is */
+        size_t truncated=0;
+        while (truncated+1 < length){
+            UChar scratch[15];
+            in=(char *)data;
+            out=(char *)scratch;
+            in_left=truncated+1;
+            out_left=sizeof(scratch);
+            if (convert(cd, &in, &in_left, &out, &out_left) != (size_t)-1 || errno != EINVAL) break;
+            truncated++;
+        }
+        return truncated?truncated:1;
+    }
+    cell->err=U_BUFFER_OVERFLOW_ERROR;
+    return 1;
+}
+#endif
+
+#ifdef ENABLE_GCONV
+/* iconv_step with a module and the validator's state */
+static size_t gconv_step(const gconv_nonsense * gconv, __mbstate_t * state, const unsigned char * data, size_t length, Cell * cell){
+    uint32_t ucs4[15];
+    for (size_t capacity=1; capacity <= 15; capacity++){
+        size_t count, used, units_length=0;
+        const int status=gconv_run(gconv, state, data, length, false, ucs4, capacity, &count, &used);
+        if (status == __GCONV_FULL_OUTPUT && !used) continue;
+        if (used) {
+            cell->err=gconv_cell(ucs4, count, cell->str_utf16, &units_length);
+            cell->length_utf16=units_length;
+            return used;
+        }
+        cell->err=gconv_error(status);
+        return status == __GCONV_INCOMPLETE_INPUT?0:1;
+    }
+    cell->err=U_BUFFER_OVERFLOW_ERROR;
+    return 1;
+}
+#endif
+
+/*
+ * The character at the start of data, as many bytes of it as there are.
+ * Returns how many bytes to move past: the character's, the ones before a
+ * byte that can't continue it, or 0 with U_TRUNCATED_CHAR_FOUND if data
+ * ends inside it, in which case the state hasn't moved.
+ */
+static size_t validate_step(Validator * validator, const unsigned char * data, size_t length, Cell * cell){
+    const Config config=validator->config;
+    cell->err=U_ZERO_ERROR;
+    cell->length_utf16=0;
+    switch (config.backend){
+        #ifdef ENABLE_ICONV
+        case ICONV:
+            return iconv_step((iconv_function)iconv, config.converter, data, length, cell);
         #endif
         #ifdef ENABLE_LIBICONV
-        case LIBICONV: {
-            /* Silly endianess hack */
-            union {
-                char is_little_endian:8;
-                UChar32 a;
-            } e={.a=1};
-            config.converter=libiconv_open(
-                e.is_little_endian?"UTF-16LE":"UTF-16BE",
-                argv[optind]
-            );
-            if (config.converter==(void *)-1){
-                config.fail=true;
-                errmsg="No such codepage %s\n";
-                goto end;
-            }
-            
-        } break;
+        case LIBICONV:
+            return iconv_step((iconv_function)libiconv, config.converter, data, length, cell);
         #endif
-        #ifdef ENABLE_MAPFILE
-        case MAPPING_FILE:
-            config.converter=malloc(sizeof(MappingTable));
-            FILE * mapping_file=fopen(argv[optind], "rt");
-            if (!mapping_file) {
-                errmsg="No such file %s\n";
-                config.fail=true;
-                goto end;
+        #ifdef ENABLE_GCONV
+        case GCONV:
+            return gconv_step(config.converter, &validator->gconv, data, length, cell);
+        #endif
+        /* Both tries decode from the initial state, one lookup per byte */
+        case LOCALE: {
+            const LocaleConverter * converter=config.converter;
+            LocaleNode * node=converter->root;
+            for (size_t i=0; i<length; i++){
+                LocaleEntry * entry=&node->entries[data[i]];
+                if (entry->kind == MAP_ENTRY_CHARACTER) {
+                    memcpy(cell->str_utf16, entry->units, entry->length*sizeof(UChar));
+                    cell->length_utf16=entry->length;
+                    return i+1;
+                }
+                if (entry->kind != MAP_ENTRY_INCOMPLETE || i+1 >= MB_LEN_MAX) {
+                    cell->err=U_ILLEGAL_CHAR_FOUND;
+                    return i?i:1;
+                }
+                node=locale_child(converter, entry, data, i+1);
             }
-                
-            *(MappingTable *)config.converter=parse_mapping_file(mapping_file);
-            fclose(mapping_file);
-            if (!((MappingTable *)config.converter)->table){
-                config.fail=true;
-                errmsg="Invalid mapping file %s\n";
-                goto end;
+            cell->err=U_TRUNCATED_CHAR_FOUND;
+            return 0;
+        }
+        case MAPPING_FILE: {
+            const MapConverter * map=config.converter;
+            if (!map->base) break;
+            uint32_t node=0;
+            for (size_t i=0; i<length; i++){
+                size_t units_length=0;
+                cell->err=convert_map_image(map, &node, data+i, 1, cell->str_utf16, &units_length);
+                cell->length_utf16=units_length;
+                if (cell->err != U_TRUNCATED_CHAR_FOUND)
+                    return U_FAILURE(cell->err) && i?i:i+1;
             }
+            return 0;
+        }
+        default:
+        break;
+    }
+    /* Anything else keeps no state, so a cell at a time with convert_cell will do */
+    enum {max_length=8};
+    size_t cell_length=0;
+    do {
+        cell_length++;
+        convert_cell(config, (char *)data, cell_length, cell);
+    } while (cell->err == U_TRUNCATED_CHAR_FOUND && cell_length < length && cell_length < max_length);
+    if (cell->err == U_TRUNCATED_CHAR_FOUND) return cell_length == length?0:cell_length;
+    if (U_SUCCESS(cell->err)) return cell_length;
+    return cell_length > 1?cell_length-1:1;
+}
 
+/* What iconv and gconv held back for the end of the stream */
+static void validate_flush(Validator * validator, uint64_t offset){
+    const Config config=validator->config;
+    Cell cell={0};
+    size_t units_length=0;
+    switch (config.backend){
+        #ifdef ENABLE_ICONV
+        case ICONV: {
+            char * out=(char *)cell.str_utf16;
+            size_t out_left=sizeof(cell.str_utf16);
+            iconv(config.converter, NULL, NULL, &out, &out_left);
+            units_length=15-out_left/sizeof(UChar);
+        } break;
+        #endif
+        #ifdef ENABLE_LIBICONV
+        case LIBICONV: {
+            char * out=(char *)cell.str_utf16;
+            size_t out_left=sizeof(cell.str_utf16);
+            libiconv(config.converter, NULL, NULL, &out, &out_left);
+            units_length=15-out_left/sizeof(UChar);
+        } break;
+        #endif
+        #ifdef ENABLE_GCONV
+        case GCONV: {
+            uint32_t ucs4[15];
+            size_t count;
+            gconv_run(config.converter, &validator->gconv, (const unsigned char *)"", 0, true, ucs4, 15, &count, NULL);
+            gconv_cell(ucs4, count, cell.str_utf16, &units_length);
+        } break;
+        #endif
+        default:
         break;
+    }
+    for (int32_t u=0; u<(int32_t)units_length;){
+        UChar32 c;
+        U16_NEXT(cell.str_utf16, u, (int32_t)units_length, c);
+        validate_codepoint(validator, offset, c);
+    }
+}
+
+static size_t validate_block_cells(Validator * validator, const unsigned char * data, size_t length, uint64_t base, bool last){
+    if (!validator->started) {
+        #ifdef ENABLE_ICONV
+        if (validator->config.backend == ICONV) iconv(validator->config.converter, NULL, NULL, NULL, NULL);
+        #endif
+        #ifdef ENABLE_LIBICONV
+        if (validator->config.backend == LIBICONV) libiconv(validator->config.converter, NULL, NULL, NULL, NULL);
         #endif
+        validator->started=true;
     }
-end:
-    if (config.fail)
-        fprintf(stderr,errmsg, argv[optind]);
-    
+    size_t pos=0;
+    while (pos < length && !validate_gave_up(validator)){
+        if (validator->ascii_fast_path) {
+            pos+=ascii_run(data+pos, length-pos, validator->detect);
+            if (pos == length) break;
+        }
+        Cell cell;
+        size_t cell_length=validate_step(validator, data+pos, length-pos, &cell);
+        if (cell.err == U_TRUNCATED_CHAR_FOUND && !cell_length) {
+            if (!last) return pos;
+            cell_length=length-pos;
+        }
+        if (U_SUCCESS(cell.err)) {
+            for (int32_t u=0; u<cell.length_utf16;){
+                UChar32 c;
+                U16_NEXT(cell.str_utf16, u, cell.length_utf16, c);
+                validate_codepoint(validator, base+pos, c);
+            }
+        } else
+            validate_report(validator, validate_category(cell.err), base+pos, data+pos, cell_length, 0, cell.err);
+        pos+=cell_length;
+    }
+    if (last && pos == length) validate_flush(validator, base+pos);
+    return pos;
+}
 
+static size_t validate_block(Validator * validator, const unsigned char * data, size_t length, uint64_t base, bool last){
+    return (validator->config.backend == ICU?validate_block_icu:validate_block_cells)(validator, data, length, base, last);
+}
 
-    return config;
+/*
+ * Every byte ascii_run skips is on its own one character the validator
+ * has nothing to say about, and the converter keeps no state
+ */
+static bool ascii_compatible(const Config config, bool printable){
+    if (config.backend == ICU && !icu_batchable(config.converter)) return false;
+    /* iconv can't say whether it keeps state */
+    #ifdef ENABLE_ICONV
+    if (config.backend == ICONV) return false;
+    #endif
+    #ifdef ENABLE_LIBICONV
+    if (config.backend == LIBICONV) return false;
+    #endif
+    #ifdef ENABLE_GCONV
+    if (config.backend == GCONV && ((const gconv_nonsense *)config.converter)->step.__stateful) return false;
+    #endif
+    const inbuf_type empty={0};
+    Config narrow=config;
+    narrow.wide=false;
+    Cell cells[256];
+    convert_table(narrow, &empty, 0, cells);
+    for (int i=0; i<0x80; i++)
+        if (ascii_byte(i, printable) && (
+            U_FAILURE(cells[i].err) ||
+            cells[i].length_utf16 != 1 ||
+            (cp_flags(cells[i].str_utf16[0]) & (CP_UNDEFINED|CP_PUA|(printable?CP_CONTROL:0)))
+        ))
+            return false;
+    return true;
 }
 
-void print_fonttest(const Config config, inbuf_type * inbuf){
-#define format for(bool _once=1; _once && !config.no_format_bool; _once=0)
+/* Returns the number of problems found, or -1 if the file can't be read */
+static long validate_file(const Config config){
+    int fd=strcmp(config.validate_file, "-")?open(config.validate_file, O_RDONLY):STDIN_FILENO;
+    if (fd < 0) {
+        fprintf(stderr, "Can't open %s\n", config.validate_file);
+        return -1;
+    }
+    Validator validator={
+        .config=config,
+        .ascii_fast_path=ascii_compatible(config, false)
+    };
+    if (config.backend == ICU) ucnv_resetToUnicode(config.converter);
+    struct stat st;
+    void * data=MAP_FAILED;
+    uint64_t size=0;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0)
+        data=mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    bool ok=true;
+    if (data != MAP_FAILED) {
+        madvise(data, st.st_size, MADV_SEQUENTIAL);
+        validate_block(&validator, data, st.st_size, 0, true);
+        munmap(data, st.st_size);
+        size=st.st_size;
+    } else {
+        /* Whatever a block leaves over goes in front of the next one */
+        enum {block_size=1<<20};
+        unsigned char * block=malloc(block_size+64);
+        size_t carried=0;
+        for (;;) {
+            const ssize_t result=read(fd, block+carried, block_size);
+            if (result < 0 && errno == EINTR) continue;
+            if (result < 0) {
+                ok=false;
+                break;
+            }
+            const size_t length=carried+result;
+            const size_t used=validate_block(&validator, block, length, size, result == 0);
+            size+=used;
+            carried=length-used;
+            memmove(block, block+used, carried);
+            if (!result) break;
+        }
+        free(block);
+    }
+    if (fd != STDIN_FILENO) close(fd);
+    if (!ok) {
+        fprintf(stderr, "Can't read %s\n", config.validate_file);
+        free(validator.report.buf);
+        return -1;
+    }
+    const long problems=validator.problems;
+    format {
+        char summary[256];
+        snprintf(summary, sizeof(summary),
+            "%llu bytes: %llu invalid, %llu truncated, %llu undefined, %llu private use, %llu other errors\n",
+            (unsigned long long)size,
+            (unsigned long long)validator.counts[VALIDATE_INVALID],
+            (unsigned long long)validator.counts[VALIDATE_TRUNCATED],
+            (unsigned long long)validator.counts[VALIDATE_UNDEFINED],
+            (unsigned long long)validator.counts[VALIDATE_PUA],
+            (unsigned long long)validator.counts[VALIDATE_ERROR]
+        );
+        out_str(&validator.report, summary);
+    }
+    out_flush(&validator.report, config.output_fd);
+    free(validator.report.buf);
+    return problems;
+}
 
-    for (int table=config.from_table; table <= config.to_table; table++){
-        format printf("Table %d:\n",table);
-
-        format printf("  \e[7m0 1 2 3 4 5 6 7 8 9 a b c d e f \e[27m\n\n");
-        for (int i=0; i<16; i++){
-            format printf("\e[7m%x\e[27m ", i);
-            for (int j=0; j<16; j++){
-                int x,y;
-                if (config.no_format_bool) {
-                    x=j;
-                    y=i;
-                } else {
-                    x=config.column_order?i:j;
-                    y=config.column_order?j:i;
-                }
-                {
-                const char buf[3]={table,y*16+x,0};
-                const char * inbyte;
-                if (config.wide)
-                    inbyte=buf;
-                else 
-                    inbyte=buf+1;
-
-                memcpy(&inbuf->buf[inbuf->index],inbyte,(config.wide?3:2));
-                }
+/* Opening only happens once, tables leave it out */
+static void out_stats(OutBuf * out, const Stats * stats, bool json, bool with_open){
+    char number[64];
+    const int first=with_open?PHASE_OPEN:PHASE_CONVERT;
+    for (int phase=first; phase<PHASE_COUNT; phase++){
+        uint64_t ns=stats->ns[phase];
+        if (phase == PHASE_FORMAT) ns-=stats->ns[PHASE_NAMES];
+        if (json)
+            snprintf(number, sizeof(number), "%s\"%s_us\":%.3f", phase>first?",":"", phase_names[phase], ns/1e3);
+        else
+            snprintf(number, sizeof(number), "%s%s %.1fus", phase>first?", ":"", phase_names[phase], ns/1e3);
+        out_str(out, number);
+    }
+    snprintf(number, sizeof(number), json?",\"names\":%llu,\"cells\":{":" (%llu names);", (unsigned long long)stats->names);
+    out_str(out, number);
+    for (int legend=0; legend<LEGEND_COUNT; legend++){
+        if (json) {
+            out_str(out, legend?",\"":"\"");
+            for (const char * c=legend_names[legend]; *c; c++)
+                out_char(out, *c == ' '?'_':*c);
+            snprintf(number, sizeof(number), "\":%llu", (unsigned long long)stats->cells[legend]);
+        } else
+            snprintf(number, sizeof(number), " %llu %s", (unsigned long long)stats->cells[legend], legend_names[legend]);
+        out_str(out, number);
+    }
+    if (json) out_char(out, '}');
+}
 
-                UChar str_utf16[17]={0};
-                UChar* str_utf16_ptr=str_utf16+2;
-                size_t length_utf16;
-                switch(config.backend){
-
-                    #ifdef ENABLE_ICONV
-                    case ICONV: {
-                        size_t inbytes_left=inbuf->index+(config.wide?2:1);
-                        size_t outbytes_left=15*sizeof(UChar);
-                        char * inbuf_ptr=inbuf->buf;
-                        UChar* str_utf16_ptr_bak=str_utf16_ptr;
-
-                        size_t result=iconv(
-                            config.converter,
-                            &inbuf_ptr,
-                            &inbytes_left,
-                            (char**)&str_utf16_ptr_bak,
-                            &outbytes_left
-                        );
-                        length_utf16=15-outbytes_left/sizeof(UChar);
-
-                        if(result == (size_t) -1 ){
-                            if (errno == EINVAL) err=U_TRUNCATED_CHAR_FOUND;
-                            else if (errno == EILSEQ) err=U_ILLEGAL_CHAR_FOUND;
-                            else err=U_STANDARD_ERROR_LIMIT;
-                        }
-                            else err=U_ZERO_ERROR;
-                    }
-                    break;
-                    #endif
-                    #ifdef ENABLE_LIBICONV
-                    case LIBICONV: {
-                        size_t inbytes_left=inbuf->index+(config.wide?2:1);
-                        size_t outbytes_left=15*sizeof(UChar);
-                        char * inbuf_ptr=inbuf->buf;
-                        UChar* str_utf16_ptr_bak=str_utf16_ptr;
-
-                        size_t result=libiconv(
-                            config.converter,
-                            &inbuf_ptr,
-                            &inbytes_left,
-                            (char**)&str_utf16_ptr_bak,
-                            &outbytes_left
-                        );
-                        length_utf16=15-outbytes_left/sizeof(UChar);
-
-                        if(result == (size_t) -1 ){
-                            if (errno == EINVAL) err=U_TRUNCATED_CHAR_FOUND;
-                            else if (errno == EILSEQ) err=U_ILLEGAL_CHAR_FOUND;
-                            else err=U_STANDARD_ERROR_LIMIT;
-                        }
-                            else err=U_ZERO_ERROR;
-                    }
-                    break;
-                    #endif
-                    case ICU:
-                        err=U_ZERO_ERROR;
-                        length_utf16=ucnv_toUChars (
-                            config.converter,
-                            str_utf16_ptr,
-                            15,
-                            inbuf->buf,
-                            inbuf->index+(config.wide?2:1),
-                            &err
-                        );
-                    break;
-                    case LOCALE:
-                    {
-                        size_t bytes_converted=0;
-                        length_utf16=0;
-                        mbstate_t mbstate={0};
-                        bool done=false;
-                        err=U_ZERO_ERROR;
-                        while (!done && bytes_converted<inbuf->index+(config.wide?2:1)){
-                            size_t result=mbrtoc16(
-                                &str_utf16_ptr[length_utf16],
-                                &inbuf->buf[bytes_converted],
-                                inbuf->index+(config.wide?2:1)-bytes_converted,
-                                &mbstate
-                            );
-                            switch (result){
-                                case -3:
-                                    length_utf16++;
-                                break;
-                                case -2:
-                                    err=U_TRUNCATED_CHAR_FOUND;
-                                    done=true;
-                                break;
-                                case -1:
-                                    err=U_ILLEGAL_CHAR_FOUND;
-                                    done=true;
-                                break;
-                                case 0:
-                                    result=1;
-                                default:
-                                    length_utf16++;
-                                    bytes_converted+=result;
-                                break;
-
-
-                            }
-                        }
-                        }
-                    break;
-                    #ifdef ENABLE_GCONV
-                    case GCONV: {
-                        struct __gconv_step_data step_data={
-                            .__outbuf=str_utf16_ptr,
-                            .__outbufend=str_utf16_ptr+15,
-
-                            
-                        };
-                        gconv_nonsense * gconv=config.converter;
-                        size_t inbytes_left=inbuf->index+(config.wide?2:1);
-                        char * inbuf_ptr=inbuf->buf;
-                        size_t written;
-                        /*gconv->gconv(
-                            &gconv->step,
-                            &step_data,
-                            &inbuf_ptr,
-                            inbuf_ptr+inbuf->index+(config.wide?2:1),
-                            &written,
-                            0,0
-                        );*/
-                    } break;
-                    #endif
-                    #ifdef ENABLE_MAPFILE
-                    case MAPPING_FILE:{
-                        char out_buf_utf8[31];
-                        size_t outlen;
-                        convert_result r=convert(
-                            *(MappingTable*)config.converter,
-                            inbuf->buf,
-                            inbuf->index+(config.wide?2:1),
-                            out_buf_utf8,
-                            31,
-                            &outlen
-                        );
-                        if (r==CONVERSION_OK){
-                            int32_t length_utf16_i;
-                            err=U_ZERO_ERROR;
-                            u_strFromUTF8(
-                                str_utf16_ptr,
-                                15,
-                                &length_utf16_i,
-                                out_buf_utf8,
-                                outlen,
-                                &err
-                            );
-                            length_utf16=length_utf16_i;
-                        } else {
-                            static const UErrorCode error_conversion[]={
-                                [CONVERSION_OK]=U_ZERO_ERROR,
-                                [INVALID_CHARACTER]=U_ILLEGAL_CHAR_FOUND,
-                                [INCOMPLETE_CHARACTER]=U_TRUNCATED_CHAR_FOUND,
-                                [BUFFER_NOT_BIG_ENOUGH]=U_STANDARD_ERROR_LIMIT
-                            };
-                            err=error_conversion[r];
-                            length_utf16=0;
-                        }
-                        
+/* --stats: every table that was charted, then all of them added up */
+static void report_stats(const Config config){
+    current_stats=NULL;
+    Stats total=stats_setup;
+    const bool json=config.stats_file;
+    OutBuf out={0};
+    if (json) out_literal(&out, "{\"tables\":[");
+    bool first=true;
+    for (int table=0; table<256; table++){
+        const Stats * stats=&stats_tables[table];
+        if (!stats->used) continue;
+        for (int phase=0; phase<PHASE_COUNT; phase++) total.ns[phase]+=stats->ns[phase];
+        for (int legend=0; legend<LEGEND_COUNT; legend++) total.cells[legend]+=stats->cells[legend];
+        total.names+=stats->names;
+        if (json) {
+            if (!first) out_char(&out, ',');
+            out_literal(&out, "{\"table\":");
+            out_uint(&out, table);
+            out_char(&out, ',');
+        } else {
+            out_literal(&out, "Table ");
+            out_uint(&out, table);
+            out_literal(&out, ": ");
+        }
+        out_stats(&out, stats, json, false);
+        out_str(&out, json?"}":"\n");
+        first=false;
+    }
+    out_str(&out, json?"],\"total\":{":"Total: ");
+    out_stats(&out, &total, json, true);
+    out_str(&out, json?"}}\n":"\n");
+    if (!json)
+        out_flush(&out, STDERR_FILENO);
+    else {
+        const int fd=open(config.stats_file, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+        if (fd < 0)
+            fprintf(stderr, "Can't write %s\n", config.stats_file);
+        else {
+            out_flush(&out, fd);
+            close(fd);
+        }
+    }
+    free(out.buf);
+}
 
-                    }
-                    #endif 
-                    break;
-                    default:
-                        fprintf(stderr, "Backend not compiled into the binary\n");
-                }
-                // format printf("\e8\e[%dB\e[%dC",y+1,x*2+2);
-                if (err==U_INVALID_CHAR_FOUND ||
-                    err==U_ILLEGAL_CHAR_FOUND ||
-                    err==U_ILLEGAL_ESCAPE_SEQUENCE ||
-                    err==U_UNSUPPORTED_ESCAPE_SEQUENCE || 
-                    find_predicate_in_string(str_utf16_ptr,u_isundefined,length_utf16)) 
-                    format attrPrintSpace(attribute_red_background);
-                else if (err==U_TRUNCATED_CHAR_FOUND)
-                    format attrPrintSpace(attribute_green_background);
-                else if (U_FAILURE(err) ) 
-                    format attrPrintMessage(attribute_yellow_background,u_errorName(err));
-                else {
-                    const UChar *tmp;
-                    if(
-                        !config.control_codes_raw && 
-                        (tmp=find_predicate_in_string(str_utf16_ptr,u_iscntrl,length_utf16))
-                    ){
-                        if (config.verbose_control_codes_and_whitespace)
-                            format attrPrintCodepointAsHex(attribute_bright_blue_background, *tmp);
-                        else 
-                            format attrPrintSpace(attribute_blue_background);
-                    }
-                    else if(
-                        !config.control_codes_raw && 
-                        config.verbose_control_codes_and_whitespace && 
-                        (tmp=find_predicate_in_string(str_utf16_ptr, u_isUWhiteSpace, length_utf16)) && 
-                        (*tmp != ' ')
-                    )
-                        format attrPrintCodepointAsHex(attribute_light_gray_background, *tmp);
-                    else {
-                        char out_buf_utf8[33];
-                        UChar32 c;
-                        U16_GET(str_utf16_ptr, 0,0,length_utf16, c);
-                        format if (
-                            u_charType(c) == U_NON_SPACING_MARK || 
-                            u_charType(c) == U_ENCLOSING_MARK ||
-                            u_charType(c) == U_COMBINING_SPACING_MARK
-                        ){
-                            *--str_utf16_ptr=u'◌';
-                            length_utf16++;
-                        }
-                        u_strToUTF8(
-                            out_buf_utf8,
-                            33, 
-                            NULL,
-                            str_utf16_ptr,
-                            length_utf16, 
-                            &idc
-                        );
-                        
-                        if (!config.no_format_bool) {
-                            UBool isPUA=(find_predicate_in_string(str_utf16_ptr,u_isPUA, length_utf16)!=NULL);
-                            attrPrint(
-                                isPUA?attribute_magenta_background:attribute_default_background,
-                                out_buf_utf8
-                            );
-                            if (!iswide(str_utf16_ptr, length_utf16))
-                                printf(" ");
-                            
-                        }
-                        else 
-                            printf("%s", out_buf_utf8);
-                            
-                    }
-                }
-                
+/*
+ * --compile-map: the image is made by converting every byte after every
+ * incomplete prefix with convert_table, up to map_image_depth bytes, so
+ * any backend can be compiled, not only mapping files.
+ */
+typedef struct {
+    Config config;
+    inbuf_type * prefix;
+    MapNode * nodes;
+    size_t node_count, node_capacity;
+    MapEntry * entries;
+    size_t entry_count, entry_capacity;
+    OutBuf units;
+} MapBuilder;
+
+static uint32_t build_map_node(MapBuilder * builder){
+    Cell cells[256];
+    const size_t depth=builder->prefix->index;
+    convert_table(builder->config, builder->prefix, 0, cells);
+    /* The most common failure goes outside the range */
+    int32_t outside=U_ILLEGAL_CHAR_FOUND;
+    int most=0;
+    for (int i=0; i<256; i++){
+        if (U_SUCCESS(cells[i].err) || cells[i].err == U_TRUNCATED_CHAR_FOUND) continue;
+        int same=0;
+        for (int j=0; j<256; j++) same+=cells[j].err == cells[i].err;
+        if (same > most) {
+            most=same;
+            outside=cells[i].err;
+        }
+    }
+    int first=256, last=-1;
+    for (int i=0; i<256; i++)
+        if (cells[i].err != (UErrorCode)outside) {
+            if (first > i) first=i;
+            last=i;
+        }
+    if (last < 0) {
+        first=1;
+        last=0;
+    }
+    if (builder->node_count == builder->node_capacity) {
+        builder->node_capacity=builder->node_capacity?builder->node_capacity*2:256;
+        builder->nodes=realloc(builder->nodes, builder->node_capacity*sizeof(MapNode));
+    }
+    const uint32_t node=builder->node_count++;
+    const size_t count=last-first+1;
+    while (builder->entry_count+count > builder->entry_capacity) {
+        builder->entry_capacity=builder->entry_capacity?builder->entry_capacity*2:4096;
+        builder->entries=realloc(builder->entries, builder->entry_capacity*sizeof(MapEntry));
+    }
+    const uint32_t entries=builder->entry_count;
+    builder->entry_count+=count;
+    builder->nodes[node]=(MapNode){
+        .entries=entries,
+        .outside=outside,
+        .first=first,
+        .last=last
+    };
+    /* Children are added behind this node, entries are found by index every time */
+    for (int i=first; i<=last; i++){
+        MapEntry entry={0};
+        if (U_SUCCESS(cells[i].err)) {
+            entry.kind=MAP_ENTRY_CHARACTER;
+            entry.value=builder->units.length/sizeof(UChar);
+            entry.length=cells[i].length_utf16;
+            out_append(&builder->units, (const char *)cells[i].str_utf16, cells[i].length_utf16*sizeof(UChar));
+        } else if (cells[i].err == U_TRUNCATED_CHAR_FOUND) {
+            entry.kind=MAP_ENTRY_INCOMPLETE;
+            entry.value=UINT32_MAX;
+            if (depth+1 < map_image_depth) {
+                builder->prefix->buf[builder->prefix->index++]=i;
+                entry.value=build_map_node(builder);
+                builder->prefix->index--;
             }
-            format printf("\e[0m\n");
+        } else {
+            entry.kind=MAP_ENTRY_ERROR;
+            entry.value=cells[i].err;
         }
+        builder->entries[entries+i-first]=entry;
+    }
+    return node;
+}
+
+static bool compile_map_image(const Config config){
+    MapBuilder builder={
+        .config=config,
+        .prefix=calloc(1, sizeof(inbuf_type)+map_image_depth)
+    };
+    builder.config.wide=false;
+    builder.prefix->capacity=map_image_depth;
+    build_map_node(&builder);
+    const MapImageHeader header={
+        .version=MAP_IMAGE_VERSION,
+        .node_count=builder.node_count,
+        .entry_count=builder.entry_count,
+        .unit_count=builder.units.length/sizeof(UChar)
+    };
+    memcpy((char *)header.magic, map_image_magic, sizeof(header.magic));
+    FILE * image=fopen(config.map_image_file, "wb");
+    bool ok=image &&
+        fwrite(&header, sizeof(header), 1, image) == 1 &&
+        fwrite(builder.nodes, sizeof(MapNode), builder.node_count, image) == builder.node_count &&
+        fwrite(builder.entries, sizeof(MapEntry), builder.entry_count, image) == builder.entry_count &&
+        fwrite(builder.units.buf, 1, builder.units.length, image) == builder.units.length;
+    if (image && fclose(image)) ok=false;
+    if (!ok) fprintf(stderr, "Can't write %s\n", config.map_image_file);
+    free(builder.prefix);
+    free(builder.nodes);
+    free(builder.entries);
+    free(builder.units.buf);
+    return ok;
+}
 
-        format printf("\e[0m\n\n");
-        format printAllMessages();
+/* Everything after the converter is open, returns the exit code */
+static int render(Config config, const inbuf_type * inbuf){
+    if (config.map_image_file)
+        return compile_map_image(config)?0:1;
+    if (config.heatmap_file)
+        return print_heatmap(config)?0:1;
+    if (config.validate_file) {
+        const long problems=validate_file(config);
+        return problems < 0?2:problems > 0;
+    }
+    if (config.diff_target) {
+        const long differences=print_diff(config, inbuf);
+        return differences < 0?2:differences > 0;
+    }
+    if (config.cache_dir)
+        config.cache=open_cell_cache(config, inbuf);
+    if (config.reverse)
+        print_reverse(config);
+    else if (config.stateful_depth) {
+        if (!print_stateful(config, inbuf)) {
+            close_cell_cache(config.cache);
+            return 1;
+        }
+    } else if (config.explore_depth)
+        explore(config, inbuf);
+    else if (pager_usable(config))
+        browse(config, inbuf);
+    else
+        print_fonttest(config, inbuf);
+    close_cell_cache(config.cache);
+    if (config.stats) report_stats(config);
+    return 0;
+}
 
+/*
+ * --all and --list: one chart per converter name, each in its own file
+ * in the output directory. A pool of config.jobs threads takes names in
+ * order, so at most that many converters are open at once, and ICU loads
+ * its data and shares converter tables between them only once.
+ */
+typedef struct {
+    Config config;
+    const inbuf_type * inbuf;
+    char ** names;
+    int count;
+    atomic_int next;
+    atomic_bool failed;
+} Gallery;
 
-        if(config.interactive && table != config.to_table) {
-            format printf("\n[q]: ");
-            char c;
-            while (((c=getchar()) != '\n') && (c !='q'));
-            if (c=='q') {
-                break;
+static int gallery_worker(void * arg){
+    Gallery * gallery=arg;
+    const char * dir=gallery->config.output_dir?gallery->config.output_dir:".";
+    for (int i; (i=atomic_fetch_add(&gallery->next, 1)) < gallery->count;){
+        Config config=gallery->config;
+        config.codepage=gallery->names[i];
+        const char * errmsg=open_converter(&config);
+        if (errmsg) {
+            fprintf(stderr, errmsg, config.codepage);
+            atomic_store(&gallery->failed, true);
+            continue;
+        }
+        char filename[strlen(dir)+strlen(config.codepage)+6];
+        char * name=filename+sprintf(filename, "%s/", dir);
+        for (const char * c=config.codepage; *c; c++)
+            *name++=*c=='/'?'_':*c;
+        strcpy(name, ".txt");
+        config.output_fd=open(filename, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+        if (config.output_fd < 0) {
+            fprintf(stderr, "Can't write %s\n", filename);
+            atomic_store(&gallery->failed, true);
+        } else {
+            render(config, gallery->inbuf);
+            close(config.output_fd);
+        }
+        close_converter(config);
+    }
+    return 0;
+}
+
+static char ** read_names(const Config config, int * count){
+    char ** names=NULL;
+    int capacity=0;
+    *count=0;
+    if (config.all) {
+        capacity=ucnv_countAvailable();
+        names=malloc(capacity*sizeof(char *));
+        for (int i=0; i<capacity; i++)
+            names[(*count)++]=strdup(ucnv_getAvailableName(i));
+        return names;
+    }
+    FILE * list=strcmp(config.list_file, "-")?fopen(config.list_file, "r"):stdin;
+    if (!list) {
+        fprintf(stderr, "Can't open %s\n", config.list_file);
+        return NULL;
+    }
+    char * line=NULL;
+    size_t line_capacity=0;
+    ssize_t length;
+    while ((length=getline(&line, &line_capacity, list)) >= 0){
+        while (length > 0 && isspace((unsigned char)line[length-1])) line[--length]=0;
+        if (!length || *line=='#') continue;
+        if (*count == capacity) {
+            capacity=capacity?capacity*2:64;
+            names=realloc(names, capacity*sizeof(char *));
+        }
+        names[(*count)++]=strdup(line);
+    }
+    free(line);
+    if (list != stdin) fclose(list);
+    return names;
+}
+
+static bool print_gallery(const Config config, const inbuf_type * inbuf){
+    int count;
+    char ** names=read_names(config, &count);
+    if (!names) return false;
+    if (config.output_dir) mkdir(config.output_dir, 0755);
+    Gallery * gallery=calloc(1, sizeof(Gallery));
+    gallery->config=config;
+    gallery->config.jobs=1;
+    gallery->config.interactive=false;
+    gallery->inbuf=inbuf;
+    gallery->names=names;
+    gallery->count=count;
+    int jobs=config.jobs;
+    if (jobs > count) jobs=count;
+    thrd_t threads[jobs > 0?jobs:1];
+    int started=0;
+    while (started < jobs && thrd_create(&threads[started], gallery_worker, gallery) == thrd_success)
+        started++;
+    if (started == 0) gallery_worker(gallery);
+    for (int i=0; i<started; i++)
+        thrd_join(threads[i], NULL);
+    const bool ok=!atomic_load(&gallery->failed);
+    for (int i=0; i<count; i++) free(names[i]);
+    free(names);
+    free(gallery);
+    return ok;
+}
+
+/*
+ * --detect: every candidate reads the whole sample as --validate would
+ * and is scored by the problems it finds, control characters included.
+ * Candidates are taken in order by a pool of config.jobs threads, each
+ * opening its own converter, and the fewest problems any finished
+ * candidate has had so far is shared between them: a candidate that
+ * goes past it can't win and gives up then and there.
+ */
+typedef struct {
+    const char * name;
+    uint64_t counts[6];
+    uint64_t problems;
+    size_t reached;
+    int index;
+    bool opened, gave_up;
+} Candidate;
+
+typedef struct {
+    Config config;
+    const unsigned char * sample;
+    size_t size;
+    Candidate * candidates;
+    int count;
+    atomic_int next;
+    _Atomic uint64_t best;
+} Detector;
+
+static int detect_worker(void * arg){
+    Detector * detector=arg;
+    for (int i; (i=atomic_fetch_add(&detector->next, 1)) < detector->count;){
+        Candidate * candidate=&detector->candidates[i];
+        Config config=detector->config;
+        config.codepage=candidate->name;
+        const char * errmsg=open_converter(&config);
+        if (errmsg) {
+            fprintf(stderr, errmsg, config.codepage);
+            continue;
+        }
+        if (config.backend == ICU) ucnv_resetToUnicode(config.converter);
+        Validator validator={
+            .config=config,
+            .ascii_fast_path=ascii_compatible(config, true),
+            .detect=true,
+            .best=&detector->best
+        };
+        candidate->reached=validate_block(&validator, detector->sample, detector->size, 0, true);
+        close_converter(config);
+        candidate->opened=true;
+        candidate->gave_up=validate_gave_up(&validator);
+        candidate->problems=validator.problems;
+        memcpy(candidate->counts, validator.counts, sizeof(candidate->counts));
+        if (candidate->gave_up) continue;
+        uint64_t best=atomic_load(&detector->best);
+        while (validator.problems < best && !atomic_compare_exchange_weak(&detector->best, &best, validator.problems));
+    }
+    return 0;
+}
+
+/* Finished candidates by problems, then the ones that gave up by how far they got */
+static int compare_candidates(const void * a_, const void * b_){
+    const Candidate * a=a_, * b=b_;
+    if (a->opened != b->opened) return b->opened-a->opened;
+    if (a->gave_up != b->gave_up) return a->gave_up-b->gave_up;
+    if (a->gave_up && a->reached != b->reached) return a->reached < b->reached?1:-1;
+    if (a->problems != b->problems) return a->problems > b->problems?1:-1;
+    return a->index-b->index;
+}
+
+/* The whole file, mapped if it can be; *mapped says how to let go of it */
+static unsigned char * read_sample(const char * filename, size_t * size, bool * mapped){
+    int fd=strcmp(filename, "-")?open(filename, O_RDONLY):STDIN_FILENO;
+    if (fd < 0) return NULL;
+    struct stat st;
+    unsigned char * data=NULL;
+    *size=0;
+    *mapped=false;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+        void * map=mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map != MAP_FAILED) {
+            data=map;
+            *size=st.st_size;
+            *mapped=true;
+        }
+    }
+    size_t capacity=0;
+    while (!*mapped) {
+        if (*size == capacity) {
+            capacity=capacity?capacity*2:1<<16;
+            data=realloc(data, capacity);
+        }
+        const ssize_t result=read(fd, data+*size, capacity-*size);
+        if (result < 0 && errno == EINTR) continue;
+        if (result < 0) {
+            free(data);
+            if (fd != STDIN_FILENO) close(fd);
+            return NULL;
+        }
+        if (result == 0) break;
+        *size+=result;
+    }
+    if (fd != STDIN_FILENO) close(fd);
+    /* An empty sample still has to be something */
+    return data?data:malloc(1);
+}
+
+/* Returns the exit code */
+static int print_detect(const Config config){
+    size_t size;
+    bool mapped;
+    unsigned char * sample=read_sample(config.detect_file, &size, &mapped);
+    if (!sample) {
+        fprintf(stderr, "Can't read %s\n", config.detect_file);
+        return 2;
+    }
+    Config names_config=config;
+    names_config.all=!config.list_file;
+    int count;
+    char ** names=read_names(names_config, &count);
+    if (!names) {
+        if (mapped) munmap(sample, size); else free(sample);
+        return 2;
+    }
+    Detector * detector=calloc(1, sizeof(Detector));
+    detector->config=config;
+    detector->sample=sample;
+    detector->size=size;
+    detector->count=count;
+    detector->candidates=calloc(count?count:1, sizeof(Candidate));
+    atomic_init(&detector->best, UINT64_MAX);
+    for (int i=0; i<count; i++){
+        detector->candidates[i].name=names[i];
+        detector->candidates[i].index=i;
+    }
+    int jobs=config.jobs;
+    if (jobs > count) jobs=count;
+    thrd_t threads[jobs > 0?jobs:1];
+    int started=0;
+    while (started < jobs && thrd_create(&threads[started], detect_worker, detector) == thrd_success)
+        started++;
+    if (started == 0) detect_worker(detector);
+    for (int i=0; i<started; i++)
+        thrd_join(threads[i], NULL);
+
+    Candidate * candidates=detector->candidates;
+    qsort(candidates, count, sizeof(Candidate), compare_candidates);
+    OutBuf out={0};
+    int rank=0, opened=0;
+    for (int i=0; i<count && candidates[i].opened; i++){
+        const Candidate * candidate=&candidates[i];
+        opened++;
+        if (config.no_format_bool) {
+            out_str(&out, candidate->name);
+            out_char(&out, '\n');
+            continue;
+        }
+        char line[256];
+        if (candidate->gave_up)
+            snprintf(line, sizeof(line), "-\t%s\tgave up at byte %zu with %llu problems\n",
+                candidate->name,
+                candidate->reached,
+                (unsigned long long)candidate->problems
+            );
+        else {
+            if (!i || candidate->problems != candidates[i-1].problems) rank=i+1;
+            snprintf(line, sizeof(line),
+                "%d\t%s\t%llu problems: %llu invalid, %llu truncated, %llu undefined, %llu private use, %llu control, %llu other errors\n",
+                rank,
+                candidate->name,
+                (unsigned long long)candidate->problems,
+                (unsigned long long)candidate->counts[VALIDATE_INVALID],
+                (unsigned long long)candidate->counts[VALIDATE_TRUNCATED],
+                (unsigned long long)candidate->counts[VALIDATE_UNDEFINED],
+                (unsigned long long)candidate->counts[VALIDATE_PUA],
+                (unsigned long long)candidate->counts[VALIDATE_CONTROL],
+                (unsigned long long)candidate->counts[VALIDATE_ERROR]
+            );
+        }
+        out_str(&out, line);
+        if (out.length >= 1<<16) out_flush(&out, config.output_fd);
+    }
+    out_flush(&out, config.output_fd);
+    free(out.buf);
+    for (int i=0; i<count; i++) free(names[i]);
+    free(names);
+    free(candidates);
+    free(detector);
+    if (mapped) munmap(sample, size); else free(sample);
+    return opened?0:1;
+}
+
+/*
+ * --benchmark: every codepage named on the command line (or by --all and
+ * --list) is opened with every compiled in backend that has it, and the
+ * same work is timed on each. chart-1 and chart-2 are convert_table and
+ * classify_cell as print_table does them, one sample per table. bulk
+ * feeds a corpus of the codepage's own one and two byte characters,
+ * made once with the first backend that opens it, through validate_block
+ * as --detect does, one sample per block. stateful does the same with
+ * text that switches between ASCII and something else on every
+ * character, for the encodings where that costs an escape or shift.
+ */
+enum {
+    benchmark_corpus_size=1<<20,
+    benchmark_block_size=1<<16
+};
+
+static const struct {
+    const char * codepage;
+    UChar other;
+} stateful_benchmarks[]={
+    {"ISO-2022-JP", u'日'},
+    {"ISO-2022-KR", u'한'},
+    {"ISO-2022-CN", u'中'},
+    {"HZ", u'中'},
+    {"UTF-7", u'€'}
+};
+
+typedef struct {
+    const char * backend;
+    const char * codepage;
+    const char * workload;
+    uint64_t bytes, cells;
+    uint64_t total_ns;
+    uint64_t * samples;
+    size_t sample_count, sample_capacity;
+    long long heap;
+} BenchmarkResult;
+
+/* Bytes the heap grew by, where the C library can say */
+static long long heap_in_use(){
+    #if defined(__GLIBC__) && (__GLIBC__ > 2 || __GLIBC_MINOR__ >= 33)
+    return mallinfo2().uordblks;
+    #else
+    return 0;
+    #endif
+}
+
+static void benchmark_sample(BenchmarkResult * result, uint64_t start){
+    const uint64_t elapsed=monotonic_ns()-start;
+    if (result->sample_count == result->sample_capacity) {
+        result->sample_capacity=result->sample_capacity?result->sample_capacity*2:256;
+        result->samples=realloc(result->samples, result->sample_capacity*sizeof(uint64_t));
+    }
+    result->samples[result->sample_count++]=elapsed;
+    result->total_ns+=elapsed;
+}
+
+static int compare_u64(const void * a, const void * b){
+    const uint64_t x=*(const uint64_t *)a, y=*(const uint64_t *)b;
+    return (x > y)-(x < y);
+}
+
+static void print_benchmark_result(const Config config, BenchmarkResult * result, OutBuf * out){
+    qsort(result->samples, result->sample_count, sizeof(uint64_t), compare_u64);
+    double percentiles[3]={0};
+    static const double ranks[3]={0.5, 0.9, 0.99};
+    for (int i=0; i<3 && result->sample_count; i++)
+        percentiles[i]=result->samples[(size_t)(ranks[i]*(result->sample_count-1))]/1e3;
+    const double seconds=result->total_ns/1e9;
+    const double cells_per_second=seconds > 0?result->cells/seconds:0;
+    const double mb_per_second=seconds > 0?result->bytes/seconds/1e6:0;
+    char line[512];
+    switch (config.output_format){
+        case FORMAT_JSONL:
+        case FORMAT_CSV:
+            if (config.output_format == FORMAT_JSONL) out_literal(out, "{\"backend\":");
+            out_quoted(out, config.output_format, result->backend, strlen(result->backend));
+            out_str(out, config.output_format == FORMAT_JSONL?",\"codepage\":":",");
+            out_quoted(out, config.output_format, result->codepage, strlen(result->codepage));
+            out_str(out, config.output_format == FORMAT_JSONL?",\"workload\":":",");
+            out_quoted(out, config.output_format, result->workload, strlen(result->workload));
+            snprintf(line, sizeof(line), config.output_format == FORMAT_JSONL?
+                ",\"bytes\":%llu,\"cells\":%llu,\"seconds\":%.6f,\"cells_per_second\":%.0f,\"mb_per_second\":%.3f,"
+                "\"p50_us\":%.3f,\"p90_us\":%.3f,\"p99_us\":%.3f,\"samples\":%zu,\"heap_growth\":%lld}\n":
+                ",%llu,%llu,%.6f,%.0f,%.3f,%.3f,%.3f,%.3f,%zu,%lld\n",
+                (unsigned long long)result->bytes,
+                (unsigned long long)result->cells,
+                seconds,
+                cells_per_second,
+                mb_per_second,
+                percentiles[0],
+                percentiles[1],
+                percentiles[2],
+                result->sample_count,
+                result->heap
+            );
+        break;
+        default:
+            snprintf(line, sizeof(line),
+                "%s\t%s\t%s\t%.0f cells/s\t%.2f MB/s\tp50 %.1fus p90 %.1fus p99 %.1fus\theap %+lld\n",
+                result->backend,
+                result->codepage,
+                result->workload,
+                cells_per_second,
+                mb_per_second,
+                percentiles[0],
+                percentiles[1],
+                percentiles[2],
+                result->heap
+            );
+    }
+    out_str(out, line);
+    out_flush(out, config.output_fd);
+    free(result->samples);
+}
+
+static void benchmark_chart(const Config config, bool wide, BenchmarkResult * result){
+    const inbuf_type empty={0};
+    Config chart=config;
+    chart.wide=wide;
+    Cell cells[256];
+    for (int run=0; run<config.benchmark_runs; run++)
+        for (int table=0; table < (wide?256:1); table++){
+            const uint64_t start=monotonic_ns();
+            convert_table(chart, &empty, table, cells);
+            for (int i=0; i<256; i++) classify_cell(&cells[i]);
+            benchmark_sample(result, start);
+            result->cells+=256;
+            result->bytes+=256*(wide?2:1);
+        }
+}
+
+static void benchmark_bulk(const Config config, const unsigned char * corpus, size_t size, size_t characters, BenchmarkResult * result){
+    for (int run=0; run<config.benchmark_runs; run++){
+        if (config.backend == ICU) ucnv_resetToUnicode(config.converter);
+        Validator validator={
+            .config=config,
+            .ascii_fast_path=ascii_compatible(config, true),
+            .detect=true
+        };
+        for (size_t offset=0; offset < size;){
+            const size_t length=size-offset > benchmark_block_size?benchmark_block_size:size-offset;
+            const uint64_t start=monotonic_ns();
+            offset+=validate_block(&validator, corpus+offset, length, offset, offset+length == size);
+            benchmark_sample(result, start);
+        }
+        result->bytes+=size;
+        result->cells+=characters;
+    }
+}
+
+/* Random one and two byte characters of the codepage, NULL if it has none */
+static unsigned char * benchmark_corpus(const Config config, size_t * size, size_t * characters){
+    const inbuf_type empty={0};
+    Config chart=config;
+    Cell lead[256], cells[256];
+    chart.wide=false;
+    convert_table(chart, &empty, 0, lead);
+    uint8_t (* pool)[3]=malloc(257*256*sizeof(*pool));
+    size_t count=0;
+    for (int i=0; i<256; i++){
+        if (U_SUCCESS(lead[i].err) && lead[i].length_utf16)
+            memcpy(pool[count++], (uint8_t [3]){1, i}, 3);
+        if (lead[i].err != U_TRUNCATED_CHAR_FOUND) continue;
+        chart.wide=true;
+        convert_table(chart, &empty, i, cells);
+        chart.wide=false;
+        for (int j=0; j<256; j++)
+            if (U_SUCCESS(cells[j].err) && cells[j].length_utf16)
+                memcpy(pool[count++], (uint8_t [3]){2, i, j}, 3);
+    }
+    unsigned char * corpus=NULL;
+    *size=*characters=0;
+    if (count) {
+        corpus=malloc(benchmark_corpus_size+2);
+        uint32_t random=1;
+        while (*size < benchmark_corpus_size){
+            random=random*1103515245+12345;
+            const uint8_t * character=pool[(random>>8)%count];
+            memcpy(corpus+*size, character+1, character[0]);
+            *size+=character[0];
+            ++*characters;
+        }
+    }
+    free(pool);
+    return corpus;
+}
+
+/* ASCII and other taking turns, in codepage as ICU writes it */
+static unsigned char * stateful_corpus(const char * codepage, UChar other, size_t * size, size_t * characters){
+    UErrorCode err=U_ZERO_ERROR;
+    UConverter * converter=ucnv_open(codepage, &err);
+    if (U_FAILURE(err)) return NULL;
+    *characters=benchmark_corpus_size/4;
+    UChar * text=malloc(*characters*sizeof(UChar));
+    for (size_t i=0; i<*characters; i++)
+        text[i]=i&1?other:u'a'+i/2%26;
+    const int32_t capacity=*characters*8;
+    unsigned char * corpus=malloc(capacity);
+    *size=ucnv_fromUChars(converter, (char *)corpus, capacity, text, *characters, &err);
+    ucnv_close(converter);
+    free(text);
+    if (U_FAILURE(err)) {
+        free(corpus);
+        return NULL;
+    }
+    return corpus;
+}
+
+/* Room for every sample is made up front so it doesn't count as heap growth */
+static BenchmarkResult benchmark_result(const char * backend, const char * codepage, const char * workload, size_t samples){
+    BenchmarkResult result={
+        .backend=backend,
+        .codepage=codepage,
+        .workload=workload,
+        .samples=malloc(samples*sizeof(uint64_t)),
+        .sample_capacity=samples
+    };
+    result.heap=heap_in_use();
+    return result;
+}
+
+static void benchmark_finish(const Config config, BenchmarkResult * result, OutBuf * out){
+    result->heap=heap_in_use()-result->heap;
+    print_benchmark_result(config, result, out);
+}
+
+/* Returns the exit code */
+static int print_benchmark(const Config config){
+    int count=0;
+    char ** names=NULL;
+    if (config.all || config.list_file) {
+        names=read_names(config, &count);
+        if (!names) return 2;
+    } else if (config.codepage) {
+        names=malloc(sizeof(char *));
+        names[count++]=strdup(config.codepage);
+    }
+    OutBuf out={0};
+    if (config.output_format == FORMAT_CSV)
+        out_literal(&out, "backend,codepage,workload,bytes,cells,seconds,cells_per_second,mb_per_second,p50_us,p90_us,p99_us,samples,heap_growth\n");
+    int opened=0;
+    for (int n=0; n<count; n++){
+        unsigned char * corpus=NULL;
+        size_t size=0, characters=0;
+        const size_t runs=config.benchmark_runs;
+        for (size_t b=0; b<sizeof(backends)/sizeof(backends[0]); b++){
+            Config bench=config;
+            bench.backend=backends[b].backend;
+            bench.codepage=names[n];
+            if (open_converter(&bench)) continue;
+            opened++;
+            if (!corpus) corpus=benchmark_corpus(bench, &size, &characters);
+            BenchmarkResult result=benchmark_result(backends[b].name, names[n], "chart-1", runs);
+            benchmark_chart(bench, false, &result);
+            benchmark_finish(config, &result, &out);
+            result=benchmark_result(backends[b].name, names[n], "chart-2", runs*256);
+            benchmark_chart(bench, true, &result);
+            benchmark_finish(config, &result, &out);
+            if (corpus) {
+                result=benchmark_result(backends[b].name, names[n], "bulk", runs*(size/benchmark_block_size+1));
+                benchmark_bulk(bench, corpus, size, characters, &result);
+                benchmark_finish(config, &result, &out);
             }
-            format printf("\n");
+            close_converter(bench);
         }
+        free(corpus);
+        free(names[n]);
     }
+    free(names);
+    for (size_t s=0; s<sizeof(stateful_benchmarks)/sizeof(stateful_benchmarks[0]); s++){
+        size_t size, characters;
+        unsigned char * corpus=stateful_corpus(stateful_benchmarks[s].codepage, stateful_benchmarks[s].other, &size, &characters);
+        if (!corpus) continue;
+        for (size_t b=0; b<sizeof(backends)/sizeof(backends[0]); b++){
+            Config bench=config;
+            bench.backend=backends[b].backend;
+            bench.codepage=stateful_benchmarks[s].codepage;
+            if (open_converter(&bench)) continue;
+            BenchmarkResult result=benchmark_result(
+                backends[b].name,
+                bench.codepage,
+                "stateful",
+                config.benchmark_runs*(size/benchmark_block_size+1)
+            );
+            benchmark_bulk(bench, corpus, size, characters, &result);
+            benchmark_finish(config, &result, &out);
+            close_converter(bench);
+        }
+        free(corpus);
+    }
+    out_flush(&out, config.output_fd);
+    free(out.buf);
+    if (count && !opened) {
+        fprintf(stderr, "No backend has any of the codepages\n");
+        return 1;
+    }
+    return 0;
+}
+#endif
+
+/*
+ * libcpdisp, see cpdisp.h. A converter is a Config with nothing but the
+ * backend in it, so its tables go through the same convert_table and
+ * classify_cell as the charts do.
+ */
+struct CpdispConverter {
+    Config config;
+    /* The backend's converter belongs to the one this was cloned from */
+    bool shared;
+    char codepage[];
+};
+
+CpdispConverter * cpdisp_open(const char * backend, const char * codepage, const char * data_file, char * error, size_t error_size){
+    Config config={.codepage=codepage, .data_file=data_file, .backend=ICU};
+    if (backend) {
+        size_t i=0;
+        while (i < sizeof(backends)/sizeof(backends[0]) && strcmp(backends[i].name, backend)) i++;
+        if (i == sizeof(backends)/sizeof(backends[0])) {
+            if (error) snprintf(error, error_size, "Backend %s not compiled in", backend);
+            return NULL;
+        }
+        config.backend=backends[i].backend;
+    }
+    const char * errmsg=open_converter(&config);
+    if (errmsg) {
+        if (error) {
+            snprintf(error, error_size, errmsg, codepage);
+            error[strcspn(error, "\n")]=0;
+        }
+        if (config.backend == MAPPING_FILE) close_converter(config);
+        return NULL;
+    }
+    CpdispConverter * converter=malloc(sizeof(CpdispConverter)+strlen(codepage)+1);
+    strcpy(converter->codepage, codepage);
+    config.codepage=converter->codepage;
+    converter->config=config;
+    converter->shared=false;
+    return converter;
+}
+
+CpdispConverter * cpdisp_clone(const CpdispConverter * converter){
+    const size_t size=sizeof(CpdispConverter)+strlen(converter->codepage)+1;
+    CpdispConverter * clone=malloc(size);
+    memcpy(clone, converter, size);
+    clone->config.codepage=clone->codepage;
+    clone->config.converter=clone_converter(clone->config);
+    if (!clone->config.converter) {
+        free(clone);
+        return NULL;
+    }
+    clone->shared=clone->config.converter == converter->config.converter;
+    return clone;
+}
 
+void cpdisp_close(CpdispConverter * converter){
+    if (!converter) return;
+    if (!converter->shared) close_converter(converter->config);
+    free(converter);
 }
 
+bool cpdisp_convert_table(CpdispConverter * converter, const unsigned char * prefix, size_t prefix_length, bool wide, uint8_t table, const CpdispTable * out){
+    if (prefix_length > CPDISP_MAX_PREFIX) return false;
+    union {
+        inbuf_type inbuf;
+        char storage[sizeof(inbuf_type)+CPDISP_MAX_PREFIX];
+    } bytes;
+    bytes.inbuf.capacity=bytes.inbuf.index=prefix_length;
+    if (prefix_length) memcpy(bytes.inbuf.buf, prefix, prefix_length);
+    Config config=converter->config;
+    config.wide=wide;
+    Cell cells[256];
+    convert_table(config, &bytes.inbuf, table, cells);
+    for (int i=0; i<256; i++){
+        Cell * cell=&cells[i];
+        classify_cell(cell);
+        const CellClass class=cell_class(cell);
+        uint8_t count=0;
+        if (class == CELL_VALID) for (int32_t j=0; j<cell->length_utf16; count++){
+            UChar32 c;
+            U16_NEXT(cell->str_utf16, j, cell->length_utf16, c);
+            if (out->codepoints) out->codepoints[i*CPDISP_MAX_CODEPOINTS+count]=c;
+        }
+        if (out->lengths) out->lengths[i]=count;
+        if (out->classes) out->classes[i]=class;
+        if (out->errors) out->errors[i]=cell->err;
+        if (out->flags) out->flags[i]=cell->flags;
+        /* wide_with_circle without wide is one column, the dotted circle being the other */
+        if (out->widths) out->widths[i]=cell->wide?2:cell->wide_with_circle?1:0;
+    }
+    return true;
+}
+
+#ifndef CPDISP_LIBRARY
 int main(int argc, char * argv[]){
     inbuf_type * inbuf=malloc(8*sizeof(char)+sizeof(size_t)*3);
     *inbuf=(inbuf_type){
@@ -778,34 +5755,18 @@ int main(int argc, char * argv[]){
 
     if (config.fail) return_code=1;
     else if (!config.help){
-        print_fonttest(config, inbuf);
-        switch (config.backend){
-            #ifdef ENABLE_ICONV
-            case ICONV: 
-                iconv_close(config.converter);
-            break;
-            #endif
-            #ifdef ENABLE_LIBICONV
-            case LIBICONV: 
-                libiconv_close(config.converter);
-            break;
-            #endif
-            case ICU:
-                ucnv_close(config.converter);
-            break;
-            #ifdef ENABLE_GCONV
-            case GCONV:{
-                gconv_nonsense * gconv = config.converter;
-                gconv->gconv_end(&gconv->step);
-                dlclose(gconv->shared_object);
-                free(gconv);
-
-            } break;
-            #endif
-
-                
+        if (config.benchmark_runs)
+            return_code=print_benchmark(config);
+        else if (config.detect_file)
+            return_code=print_detect(config);
+        else if (config.all || config.list_file)
+            return_code=!print_gallery(config, inbuf);
+        else {
+            return_code=render(config, inbuf);
+            close_converter(config);
         }
     }
     free(inbuf);
     return return_code;
 }
+#endif
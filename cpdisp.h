@@ -0,0 +1,83 @@
+/*
+ * libcpdisp: the conversion and classification behind cpdisp's charts,
+ * for converting tables in process instead of parsing cpdisp's output.
+ * Build cpdisp.c with -DCPDISP_LIBRARY to leave out main and the rest of
+ * the CLI.
+ *
+ * A converter is opened once per backend and codepage, and then fills a
+ * whole table at a time into arrays the caller owns, without doing any
+ * I/O. Converting allocates in two places. The flags of a block of 256
+ * code points are looked up the first time any converter reaches it and
+ * kept until the process exits (1.1MB if every block is reached). The
+ * locale backend adds a node to its decode trie the first time it reaches
+ * a byte sequence, which cpdisp_close frees. Errors, including a backend
+ * that isn't compiled in, are reported per cell through errors and
+ * classes. A converter is used by one thread at a time, cpdisp_clone
+ * makes one for another thread.
+ */
+#ifndef CPDISP_H
+#define CPDISP_H
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+enum {
+    /* Code points in a cell at most, a cell is at most 15 UTF-16 units */
+    CPDISP_MAX_CODEPOINTS=15,
+    /* Bytes before the table byte(s) at most */
+    CPDISP_MAX_PREFIX=16
+};
+
+/* What a cell's bytes are, --format binary writes the same values */
+typedef enum {
+    CPDISP_VALID,      /* one or more characters */
+    CPDISP_INVALID,    /* invalid or illegal bytes, or a bad escape sequence */
+    CPDISP_TRUNCATED,  /* the start of a longer character */
+    CPDISP_ERROR       /* anything else the backend failed with */
+} CpdispClass;
+
+/* Code point properties, a cell has those of all its code points ORed */
+enum {
+    CPDISP_UNDEFINED = 1<<0,  /* unassigned */
+    CPDISP_CONTROL = 1<<1,    /* control character */
+    CPDISP_WHITESPACE = 1<<2, /* Unicode whitespace */
+    CPDISP_PUA = 1<<3,        /* private use */
+    CPDISP_COMBINING = 1<<4,  /* Mn, Me or Mc */
+    CPDISP_NONSPACING = 1<<5, /* Mn */
+    CPDISP_WIDE = 1<<6,       /* East Asian Wide or Fullwidth */
+    CPDISP_NOT_LTR = 1<<7     /* not strong left to right */
+};
+
+/*
+ * One array per field, each with room for the 256 cells of a table, cell
+ * i being the table byte (or second byte) i. A NULL array is skipped.
+ */
+typedef struct {
+    uint32_t * codepoints;  /* 256*CPDISP_MAX_CODEPOINTS, cell i's start at i*CPDISP_MAX_CODEPOINTS */
+    uint8_t * lengths;      /* code points in the cell, 0 unless it's CPDISP_VALID */
+    uint8_t * classes;      /* CpdispClass */
+    int32_t * errors;       /* the UErrorCode the backend's result maps to */
+    uint8_t * flags;        /* CPDISP_UNDEFINED... */
+    uint8_t * widths;       /* terminal columns, 0 to 2 */
+} CpdispTable;
+
+typedef struct CpdispConverter CpdispConverter;
+
+/*
+ * backend is one of the names --diff takes ("icu", "locale", "mapfile",
+ * "iconv"... as compiled in), NULL for ICU. data_file is an ICU data
+ * package to load the codepage from, or NULL. On failure returns NULL
+ * and writes why into error, if it isn't NULL.
+ */
+CpdispConverter * cpdisp_open(const char * backend, const char * codepage, const char * data_file, char * error, size_t error_size);
+/* Another converter for the same codepage, closed before the one it came from */
+CpdispConverter * cpdisp_clone(const CpdispConverter * converter);
+void cpdisp_close(CpdispConverter * converter);
+
+/*
+ * Converts prefix+byte for every byte, or prefix+table+byte if wide, each
+ * from the initial state. Returns false if the prefix is too long.
+ */
+bool cpdisp_convert_table(CpdispConverter * converter, const unsigned char * prefix, size_t prefix_length, bool wide, uint8_t table, const CpdispTable * out);
+
+#endif
@@ -0,0 +1,34 @@
+#!/bin/sh
+# -w must not fold a table into "single byte characters" when its lead
+# byte is a character on its own but also starts longer ones.
+# Usage: tests/dead_tables.sh [path to cpdisp]
+cpdisp=${1:-./cpdisp}
+status=0
+fail(){
+    echo "FAIL: $1"
+    status=1
+}
+
+# GSM 03.38's escape to its extension table
+"$cpdisp" -w gsm-03.38-2009 | grep -q "^Table 27:$" ||
+    fail "gsm-03.38-2009 table 0x1b is summarised"
+"$cpdisp" -w gsm-03.38-2009 | grep -q "^Tables 28-127: single byte characters$" ||
+    fail "gsm-03.38-2009 tables 0x1c-0x7f aren't summarised"
+"$cpdisp" -w -r 27:27 --format csv gsm-03.38-2009 | grep -q "^1b65,valid,U_ZERO_ERROR,U+20AC," ||
+    fail "gsm-03.38-2009 1b 65 isn't U+20AC"
+"$cpdisp" -w -r 27:27 --format csv gsm-03.38-2009 | grep -q "^1b28,valid,U_ZERO_ERROR,U+007B," ||
+    fail "gsm-03.38-2009 1b 28 isn't U+007B"
+
+# ISCII's nukta, a1 e9 is OM
+"$cpdisp" -w -r 161:161 --format csv x-iscii-de | grep -aq "^a1e9,valid,U_ZERO_ERROR,U+0950," ||
+    fail "x-iscii-de a1 e9 isn't U+0950"
+"$cpdisp" -w x-iscii-de | grep -q "^Table 161:$" ||
+    fail "x-iscii-de table 0xa1 is summarised"
+
+# With a prefix, dead tables are still folded and 0x1b still isn't
+"$cpdisp" -w -x 41 gsm-03.38-2009 | grep -q "^Tables 0-26: single byte characters$" ||
+    fail "gsm-03.38-2009 after 41, tables 0x00-0x1a aren't summarised"
+"$cpdisp" -w -x 41 gsm-03.38-2009 | grep -q "^Table 27:$" ||
+    fail "gsm-03.38-2009 after 41, table 0x1b is summarised"
+
+exit $status